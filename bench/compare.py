@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""
+Compare ftext with fmt, fold and (if it is installed) par on the
+same generated text: throughput, peak RSS and how close each output
+is to what 'ftext -L' produces ("words" and "lines" are the share of
+words, and of lines ignoring spacing, that it has in common with it).
+
+	bench/compare.py [--ftext ./ftext] [--sizes 64K,1M] [--width 72] [--json out.json]
+"""
+
+import argparse
+import collections
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# The peak RSS the kernel reports for a process includes that of the
+# process it was exec'd from, and anything we start directly is exec'd
+# from a copy of this (much larger) Python process. So each tool is run
+# by a small C program that forks it afresh and reports its peak RSS.
+RUSAGE_C = r"""
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int
+main(int argc, char *argv[])
+{
+	struct rusage	ru;
+	int		status;
+	pid_t	pid;
+
+	if ((pid = fork()) == 0)
+	{
+		execvp(argv[1], argv + 1);
+		_exit(127);
+	}
+
+	if (pid < 0 || wait4(pid, &status, 0, &ru) < 0)
+		return 127;
+
+	fprintf(stderr, "%ld\n", ru.ru_maxrss);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 127;
+}
+"""
+
+
+def build_rusage(tmp):
+	src = os.path.join(tmp, "rusage.c")
+	exe = os.path.join(tmp, "rusage")
+
+	with open(src, "w") as f:
+		f.write(RUSAGE_C)
+
+	subprocess.run([os.environ.get("CC", "cc"), "-O2", "-o", exe, src], check=True)
+	return exe
+
+
+def run(rusage, argv, stdin_path, stdout_path):
+	"""Run ARGV once; return (seconds, peak RSS in KiB)."""
+	with open(stdin_path, "rb") as fin, open(stdout_path, "wb") as fout:
+		start = time.perf_counter()
+		proc = subprocess.run([rusage] + argv, stdin=fin, stdout=fout, stderr=subprocess.PIPE)
+		secs = time.perf_counter() - start
+
+	# The helper's report is the last line on standard error.
+	err = proc.stderr.decode(errors="replace").strip().splitlines()
+
+	if proc.returncode != 0 or not err:
+		raise RuntimeError("%s exited with status %d" % (argv[0], proc.returncode))
+
+	return secs, int(err[-1])
+
+
+def similarity(out, ref):
+	"""Fraction of words, and of lines, that OUT shares with REF."""
+	def overlap(a, b):
+		a = collections.Counter(a)
+		b = collections.Counter(b)
+		total = max(sum(a.values()), sum(b.values()))
+		return sum((a & b).values()) / total if total else 1.0
+
+	out_lines = [" ".join(l.split()) for l in out.splitlines() if l.strip()]
+	ref_lines = [" ".join(l.split()) for l in ref.splitlines() if l.strip()]
+
+	return overlap(out.split(), ref.split()), overlap(out_lines, ref_lines)
+
+
+def main():
+	ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+	ap.add_argument("--ftext", default="./ftext")
+	ap.add_argument("--sizes", default="64K,256K,1M")
+	ap.add_argument("--width", type=int, default=72)
+	ap.add_argument("--reps", type=int, default=3)
+	ap.add_argument("--json")
+	args = ap.parse_args()
+
+	w = str(args.width)
+	tools = [
+		("fmt -w", ["fmt", "-w", w], False),
+		("fold -s", ["fold", "-s", "-w", w], False),
+		("par", ["par", w], False),
+		("ftext -L", [args.ftext, "-L", w], True),
+		("ftext -L -j", [args.ftext, "-L", w, "-j"], True),
+	]
+	tools = [t for t in tools if t[2] or shutil.which(t[1][0])]
+
+	results = []
+	tmp = tempfile.mkdtemp(prefix="ftext-compare.")
+
+	try:
+		rusage = build_rusage(tmp)
+
+		print("%-12s %10s %10s %10s %10s %8s %8s" % ("tool", "size", "seconds", "MB/s", "RSS KiB", "words", "lines"))
+
+		for size in args.sizes.split(","):
+			corpus = os.path.join(tmp, "corpus")
+			with open(corpus, "wb") as f:
+				subprocess.run([args.ftext, "--gen-corpus=" + size], stdout=f, check=True)
+
+			nbytes = os.path.getsize(corpus)
+			outputs = {}
+
+			for name, argv, in_place in tools:
+				out = os.path.join(tmp, "out")
+				best = None
+
+				for _ in range(args.reps):
+					if in_place:
+						# ftext formats the file it is given rather than
+						# reading standard input.
+						shutil.copyfile(corpus, out)
+						secs, rss = run(rusage, argv + [out], os.devnull, os.devnull)
+					else:
+						secs, rss = run(rusage, argv, corpus, out)
+
+					if best is None or secs < best[0]:
+						best = (secs, rss)
+
+				with open(out, encoding="latin-1") as f:
+					outputs[name] = f.read()
+
+				results.append({"tool": name, "size": nbytes, "seconds": best[0],
+					"mb_s": nbytes / best[0] / (1024 * 1024), "rss_kib": best[1]})
+
+			ref = outputs["ftext -L"]
+			for r in results[-len(tools):]:
+				r["words"], r["lines"] = similarity(outputs[r["tool"]], ref)
+				print("%-12s %10d %10.4f %10.1f %10d %7.1f%% %7.1f%%" % (r["tool"], r["size"],
+					r["seconds"], r["mb_s"], r["rss_kib"], r["words"] * 100, r["lines"] * 100))
+	finally:
+		shutil.rmtree(tmp)
+
+	if args.json:
+		with open(args.json, "w") as f:
+			json.dump({"width": args.width, "results": results}, f, indent=1)
+
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -1,10 +1,14 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/perf_event.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
@@ -14,8 +18,12 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
 
 /*
  * (14/08/2019) -- Complete rewrite of how the mapped file is handled and
@@ -31,6 +39,72 @@
  * original file intact.
  */
 
+/*
+ * Static probes for bpftrace and friends, e.g.
+ *
+ *	bpftrace -e 'usdt:./ftext:ftext:extend { printf("%d\n", arg1); }'
+ *
+ * A probe is a single nop until something attaches to it. Without
+ * <sys/sdt.h> (or with 'make SDT=0') they compile to nothing.
+ */
+#if !defined(NO_SDT) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAVE_SDT 1
+# endif
+#endif
+
+#ifdef HAVE_SDT
+# define probe1(n, a) DTRACE_PROBE1(ftext, n, a)
+# define probe2(n, a, b) DTRACE_PROBE2(ftext, n, a, b)
+# define probe3(n, a, b, c) DTRACE_PROBE3(ftext, n, a, b, c)
+#else
+# define probe1(n, a) do { } while (0)
+# define probe2(n, a, b) do { } while (0)
+# define probe3(n, a, b, c) do { } while (0)
+#endif
+
+/*
+ * Portable kernels that the compiler can vectorise are built once
+ * for each of these ISA levels, and the dynamic loader picks the
+ * best one the CPU has (through an ifunc) before main() runs. The
+ * hand-written kernels are picked in select_kernels() instead, so
+ * that FTEXT_SIMD can still cap them. 'make MULTIVERSION=0' builds
+ * only the baseline.
+ */
+#if defined(__x86_64__) && !defined(NO_MULTIVERSION) && defined(__has_attribute)
+# if __has_attribute(target_clones)
+#  define HAVE_MULTIVERSION 1
+# endif
+#endif
+
+#ifdef HAVE_MULTIVERSION
+# define multiversion __attribute__((__target_clones__("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+# define multiversion
+#endif
+
+/*
+ * Which build of the multiversioned kernels the loader picked,
+ * by the same rules as the resolver.
+ */
+static const char *
+clone_level(void)
+{
+#ifdef HAVE_MULTIVERSION
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("x86-64-v4"))
+		return "x86-64-v4";
+	if (__builtin_cpu_supports("x86-64-v3"))
+		return "x86-64-v3";
+
+	return "baseline";
+#else
+	return "off";
+#endif
+}
+
 
 /*
  * Must use \x1b instead of \e as the latter does not
@@ -46,6 +120,17 @@
 #endif
 
 static int MAX_LENGTH = 0;
+static int FOLD_WIDTH = 0;	/* --fold */
+
+/*
+ * -L can give several line lengths, as in -L 60,72,100, in which
+ * case each is written to its own file named from the -o template.
+ */
+#define MAX_WIDTHS	16
+
+static int		WIDTHS[MAX_WIDTHS];
+static int		NR_WIDTHS;
+static char		*OUTPUT_TEMPLATE;
 
 typedef struct mapped_file_t
 {
@@ -57,22 +142,111 @@ typedef struct mapped_file_t
 	size_t	original_file_size;
 	size_t	current_file_size;
 	int			flags; // MAP_SHARED / MAP_PRIVATE...
+	int			width;			/* --dry-run: the width to align to without -L */
+	size_t	reserved;		/* --reserve: bytes kept allocated until the end */
+	size_t	*growth;		/* --reserve: what each phase adds, by phase */
+	size_t	grow_hint;	/* and what the one running now does */
 } mapped_file_t;
 
+/*
+ * One of these for each file named on the command line.
+ */
+typedef struct job_t
+{
+	char					*name;
+	mapped_file_t	file;
+	size_t				size;		/* size of the file before we started */
+	int						status;
+} job_t;
+
 typedef struct global_data_t
 {
-	int		total_lines;
-	int		done_lines;
+	size_t	total_bytes;	/* sum of the sizes of all of the files */
+	int			finished;
 } global_data_t;
 
+/*
+ * Each file goes through normalisation and then up to two
+ * formatting operations. Workers publish the phase they are
+ * in so that the progress thread can label their bars.
+ */
+#define PHASE_IDLE				0
+#define PHASE_NORMALISE		1
+#define PHASE_LENGTH			2
+#define PHASE_JUSTIFY			3
+#define PHASE_UNJUSTIFY		4
+#define PHASE_LALIGN			5
+#define PHASE_RALIGN			6
+#define PHASE_CALIGN			7
+#define PHASE_FOLD				8
+#define NR_PHASE_TYPES		9
+
+#define EVENT_FILE_START	1
+#define EVENT_FILE_END		2
+#define EVENT_PHASE_START	3
+#define EVENT_PHASE_END		4
+
+typedef struct progress_event_t
+{
+	uint64_t	ns;
+	size_t		bytes;
+	size_t		lines;
+	size_t		extra;		/* size of the file when it was finished */
+	int				job;
+	int16_t		status;
+	uint8_t		type;
+	uint8_t		phase;
+} progress_event_t;
+
+/*
+ * Progress is measured in bytes of input consumed. Each worker
+ * owns one of these slots and is the only one to ever write
+ * to it (save for the TAIL of the event ring); the progress
+ * thread reads them. Aligning each one to a cache line means
+ * that the workers never write to the same line as one another.
+ *
+ * Phase and file boundaries are published as events on a
+ * single-producer/single-consumer ring, so that the progress
+ * thread sees every one of them however short-lived, without
+ * any locking.
+ */
+#define CACHELINE_SIZE		64
+#define MAX_WORKERS				64
+#define EVENT_RING_SIZE		256
+
+typedef struct progress_slot_t
+{
+	size_t		done_bytes;			/* of the current phase */
+	size_t		done_lines;
+	size_t		phase_bytes;
+	size_t		file_bytes;
+	size_t		finished_bytes;	/* sizes of the files this worker has finished */
+	size_t		work_bytes;			/* bytes consumed in the phases finished so far */
+	size_t		work_lines;
+	int				phase;
+	int				phase_idx;
+	int				job;
+	unsigned	head __attribute__((__aligned__(CACHELINE_SIZE)));
+	unsigned	tail __attribute__((__aligned__(CACHELINE_SIZE)));
+	progress_event_t	ring[EVENT_RING_SIZE];
+} __attribute__((__aligned__(CACHELINE_SIZE))) progress_slot_t;
+
 /*
  * Volatile, otherwise the compiler
  * will optimise it away.
  */
 static volatile global_data_t	global_data;
-static mapped_file_t	file;
+static progress_slot_t	progress_slots[MAX_WORKERS];
+static __thread progress_slot_t	*PROGRESS = &progress_slots[0];
+static uint64_t	START_NS;
+static job_t		*JOBS;
+static int			NR_JOBS;
+static int			NEXT_JOB;
+static int			NR_WORKERS = 1;
+static int			NR_CPUS = 1;
+static const char	*SIMD_LEVEL = "scalar";	/* hand-written kernels in use */
+static int			NR_PHASES;		/* phases each file goes through */
 static struct winsize			WINSIZE;
-static int		POSITION;
 static uint32_t	user_options;
 
 #define test_flag(f) (user_options & (f))
@@ -85,6 +259,15 @@ static uint32_t	user_options;
 #define LALIGN		0x8u
 #define RALIGN		0x10u
 #define CALIGN		0x20u
+#define CRLF			0x40u
+#define FOLD			0x80u
+#define SPLIT_ONLY	0x100u
+#define INCREMENTAL	0x200u
+#define CHECKPOINT	0x400u
+#define RESUME			0x800u
+#define ANALYSE			0x1000u
+#define DRY_RUN			0x2000u
+#define RESERVE			0x4000u
 
 #define ALIGNMENT_MASK	0x3eu
 
@@ -113,6 +296,82 @@ do {																											\
 		fprintf(stderr, "main: can only specify one alignment type\n");\
 		goto fail;																						\
 	}																												\
+	if (test_flag(LENGTH) && MAX_LENGTH < 2)								\
+	{																												\
+		fprintf(stderr, "main: line length must be at least 2\n");\
+		goto fail;																						\
+	}																												\
+	if (test_flag(ANALYSE)																	\
+			&& ((user_options & ~(ANALYSE|LENGTH))							\
+			|| OUTPUT_TEMPLATE))																\
+	{																												\
+		fprintf(stderr, "main: --analyze only goes with -L\n");\
+		goto fail;																						\
+	}																												\
+	if (test_flag(RESERVE)																	\
+			&& (test_flag(DRY_RUN)															\
+			|| test_flag(INCREMENTAL)														\
+			|| test_flag(CHECKPOINT)														\
+			|| OUTPUT_TEMPLATE))																\
+	{																												\
+		fprintf(stderr, "main: --reserve cannot be used with --dry-run, --incremental, --checkpoint or -o\n");\
+		goto fail;																						\
+	}																												\
+	if (NR_WIDTHS > 1 && !OUTPUT_TEMPLATE && !test_flag(ANALYSE))\
+	{																												\
+		fprintf(stderr, "main: several line lengths need -o\n");\
+		goto fail;																						\
+	}																												\
+	if (test_flag(FOLD)																			\
+			&& (test_flag(LENGTH)																\
+			|| (user_options & ALIGNMENT_MASK)									\
+			|| test_flag(CRLF)))																\
+	{																												\
+		fprintf(stderr, "main: --fold cannot be used with -L, an alignment or --crlf\n");\
+		goto fail;																						\
+	}																												\
+	if (test_flag(SPLIT_ONLY)																\
+			&& (!test_flag(LENGTH)															\
+			|| (user_options & ALIGNMENT_MASK)									\
+			|| test_flag(CRLF)																	\
+			|| test_flag(FOLD)																	\
+			|| OUTPUT_TEMPLATE))																\
+	{																												\
+		fprintf(stderr, "main: --split-only needs -L, and cannot be used with an alignment, --crlf, --fold or -o\n");\
+		goto fail;																						\
+	}																												\
+	if (test_flag(INCREMENTAL)															\
+			&& (!test_flag(LENGTH)															\
+			|| test_flag(CRLF)																	\
+			|| test_flag(FOLD)																	\
+			|| test_flag(SPLIT_ONLY)														\
+			|| OUTPUT_TEMPLATE))																\
+	{																												\
+		fprintf(stderr, "main: --incremental needs -L, and cannot be used with --crlf, --fold, --split-only or -o\n");\
+		goto fail;																						\
+	}																												\
+	if (test_flag(CHECKPOINT)																\
+			&& ((user_options & (ALIGNMENT_MASK & ~JUSTIFY))		\
+			|| test_flag(CRLF)																	\
+			|| test_flag(FOLD)																	\
+			|| test_flag(SPLIT_ONLY)														\
+			|| test_flag(INCREMENTAL)														\
+			|| OUTPUT_TEMPLATE))																\
+	{																												\
+		fprintf(stderr, "main: --checkpoint and --resume only go with -L and -j\n");\
+		goto fail;																						\
+	}																												\
+	if (OUTPUT_TEMPLATE && !test_flag(LENGTH))							\
+	{																												\
+		fprintf(stderr, "main: -o needs -L\n");								\
+		goto fail;																						\
+	}																												\
+	if (NR_WIDTHS > 1 && OUTPUT_TEMPLATE										\
+			&& !strstr(OUTPUT_TEMPLATE, "%w"))									\
+	{																												\
+		fprintf(stderr, "main: -o needs a %%w for several line lengths\n");\
+		goto fail;																						\
+	}																												\
 	if (test_flag(LENGTH) && test_flag(UNJUSTIFY))					\
 		unset_flag(UNJUSTIFY);																\
 } while (0)
@@ -120,57 +379,109 @@ do {																											\
 		/* Thread-related variables */
 //static pthread_attr_t	tATTR;
 static pthread_t			TID_SP;
+static pthread_mutex_t	PROGRESS_MTX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		PROGRESS_COND = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t	WINCH_PENDING;
+
+#define PROGRESS_REFRESH_NS		250000000L
+#define PROGRESS_EWMA_ALPHA		0.3
+#define STR_PROGRESS_NORMALISE	"[   Normalising text   ]"
 #define STR_PROGRESS_LENGTH	 		"[ Changing line length ]"
 #define STR_PROGRESS_JUSTIFY		"[   Justifying lines   ]"
 #define STR_PROGRESS_UNJUSTIFY	"[  Unjustifying lines  ]"
 #define STR_PROGRESS_LALIGN			"[  Left aligning lines ]"
 #define STR_PROGRESS_RALIGN			"[ Right aligning lines ]"
 #define STR_PROGRESS_CALIGN			"[    Centering lines   ]"
+#define STR_PROGRESS_FOLD				"[    Folding lines     ]"
 
 #define reset_global()					\
 {																\
-	global_data.total_lines = 0;	\
-	global_data.done_lines = 0;		\
+	global_data.total_bytes = 0;	\
+	global_data.finished = 0;			\
+	memset(progress_slots, 0, sizeof(progress_slots));\
 }
 
+/*
+ * Relaxed atomics are enough here: the counters are
+ * only ever read to draw the progress bars.
+ */
+#define progress_update(b, l)																			\
+do {																																\
+	__atomic_store_n(&PROGRESS->done_bytes, (size_t)(b), __ATOMIC_RELAXED);\
+	__atomic_store_n(&PROGRESS->done_lines, (size_t)(l), __ATOMIC_RELAXED);\
+} while (0)
+
 #define clear_struct(s) memset((void *)(s), 0, sizeof(*(s)))
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-/**
- * When we execute __extend_file_and_map(), the VMA could
- * be copied to a new area. So the current local pointers
- * would have to be updated.
- */
-#define check_pointers()																\
-do {																										\
-	if ((void *)startp != file->startp)			\
-	{																				\
-		char *old_startp = startp;			\
-		startp = (char *)file->startp;			\
-		endp = (char *)file->endp;			\
-		line_start = (startp + (line_start - old_startp));\
-		line_end = (startp + (line_end - old_startp));	\
-		p = (startp + (p - old_startp));		\
-	}							\
-	else							\
-	{							\
-		endp = (char *)file->endp;			\
-	}							\
-} while (0)
-
 static void
 __attribute__((__noreturn__)) usage(int exit_status)
 {
 	fprintf(stdout,
 
-		"change_line_length [OPTIONS] </path/to/file>\n"
+		"change_line_length [OPTIONS] </path/to/file> [/path/to/file ...]\n"
 		"\n"
 		" -L	Specify  the  length of line (this also left-aligns the text  by  default)\n"
 		" -j	Justify the text (cannot be used with -r, -c or -u\n"
 		" -u	Unjustify the text (cannot be used with -j)\n"
 		" -r	Right-align  the  text (must also use -L to specify desired  line  length)\n"
 		" -c	Centre-align  the  text (must also use -L to specify desired line  length)\n"
+		" -t	Number  of  files to format in parallel (0 for one per CPU; default is 1)\n"
+		" -o	Write  the  result  to this file instead of over the original, with each\n"
+		"	%%w replaced by the line length. -L may then give several lengths, as in\n"
+		"	-L 60,72,100 -o out.%%w.txt, and each is written to its own file\n"
+		" --fold=N\n"
+		"	Cut the lines every N bytes, without regard for words and without\n"
+		"	normalising the text first (cannot be used with -L or an alignment)\n"
+		" --split-only\n"
+		"	With -L, only split the lines that are too long, at the last space\n"
+		"	that fits, and leave every other line (and the text) as it is\n"
+		" --incremental\n"
+		"	With -L, keep an index of the paragraphs written beside the file\n"
+		"	(FILE.ftext-index) and on later runs only format the paragraphs\n"
+		"	that have changed since\n"
+		" --checkpoint[=SIZE]\n"
+		"	Record how far each pass has got in FILE.ftext-journal every SIZE bytes\n"
+		"	(default 1G), so that a run that is killed can be carried on with\n"
+		"	(only with -L and -j)\n"
+		" --resume\n"
+		"	Carry on from the journal left by a run with --checkpoint that was killed,\n"
+		"	given the same options\n"
+		" --analyze\n"
+		"	Print the widths of the lines and words of each file, its CRs and runs\n"
+		"	of blanks, and how many lines and words are longer than each line\n"
+		"	length given with -L, as a line of JSON, and change nothing\n"
+		" --dry-run\n"
+		"	Print the size of each file before and after formatting, the size after\n"
+		"	each step and the bytes each inserts and deletes, and the space it needs,\n"
+		"	as a line of JSON (one for each length, with -o), and change nothing\n"
+		" --reserve\n"
+		"	Allocate all the space formatting the file needs before starting, so\n"
+		"	that a full disk stops the run before anything is changed\n"
+		" --crlf\n"
+		"	End the lines of the formatted file with CRLF instead of LF\n"
+		" --hyphens=soft|hard\n"
+		"	Drop (soft, the default) or keep (hard) the hyphen when rejoining a word\n"
+		"	that was broken across two lines\n"
+		" --progress-fd=N\n"
+		"	Write progress and results as newline-delimited JSON to file descriptor N\n"
+		" --stats\n"
+		"	Print the time spent in each phase once finished\n"
+		" --perf-counters\n"
+		"	Also count cycles, instructions, branch, LLC and dTLB misses in each phase\n"
+		" --check-bounds\n"
+		"	Fail if a phase makes more syscalls or moves more data than it should\n"
+		"	(needs a build with 'make ACCOUNTING=1')\n"
+		" --bench[=SIZES]\n"
+		"	Time each operation on generated text of each size (default 16K,64K,256K)\n"
+		"	with 1, 2, 4 ... N workers (N is given with -t, or one per CPU)\n"
+		" --bench-json=FILE\n"
+		"	Save the benchmark results to FILE\n"
+		" --bench-baseline=FILE\n"
+		"	Flag results more than 10%% slower than those saved in FILE\n"
+		" --gen-corpus=SIZE\n"
+		"	Write SIZE bytes of generated text (e.g. 64K, 16M) to standard output\n"
 		" -h	Display this information menu\n"
 		"\n"
 		"\n"
@@ -189,1377 +500,7409 @@ __attribute__((__noreturn__)) usage(int exit_status)
 		"\n"
 		"change_line_length -u /home/Documents/My_Document.txt\n"
 		"	Unjustifies  \"My_Document.txt\",  which will, by default,  be  left-aligned.\n"
+		"\n"
+		"change_line_length -t 4 -L 72 -j /home/Documents/*.txt\n"
+		"	formats all of the documents, four at a time, showing the progress of\n"
+		"	each one as well as the overall progress\n"
 		"\n");
 
 	exit(exit_status);
 }
 
-static void
-deleteline(void)
+/*
+ * Frame-buffered terminal renderer.
+ *
+ * Everything that is displayed is first composed into BACK, a grid of
+ * character cells (each with a colour attribute) the size of the terminal
+ * window. render_flush() then diffs BACK against FRONT (what we believe is
+ * currently on the screen), builds the escape sequences for only the cells
+ * that changed in a memory buffer and hands the lot to the kernel in a single
+ * write(2). The cost of a refresh is therefore proportional to what changed
+ * and not to the size of the terminal.
+ */
+#define ATTR_NONE			0
+#define ATTR_DISPLAY		1
+#define ATTR_PROGRESS		2
+#define ATTR_STATS			3
+
+static const char	*attr_colours[] =
 {
-	int		i;
+	END_COL,
+	DISPLAY_COLOUR,
+	PROGRESS_COLOUR,
+	FILE_STATS_COLOUR
+};
 
-	putchar(0x0d);
-	for (i = 0; i < WINSIZE.ws_col; ++i)
-		putchar(0x20);
-	putchar(0x0d);
-}
+typedef struct frame_t
+{
+	int			rows;
+	int			cols;
+	char		*cells;
+	uint8_t	*attrs;
+} frame_t;
 
-static void
-clear(void)
+typedef struct renderer_t
 {
-	int		i;
+	frame_t	front;
+	frame_t	back;
+	char		*obuf;
+	size_t	olen;
+	size_t	osize;
+	int			enabled;
+	int			full_redraw;
+} renderer_t;
 
-	putchar(0x0d);
-	for (i = 0; i < WINSIZE.ws_row; ++i)
-		printf("\e[A");
+static renderer_t	RENDER;
 
-	for (i = 0; i < WINSIZE.ws_row; ++i)
-	{
-		deleteline();
-		if (i != (WINSIZE.ws_row-1))
-			putchar(0x0a);
-	}
-	putchar(0x0d);
-}
+#define cell_index(fr, r, c) ((size_t)(r) * (size_t)(fr)->cols + (size_t)(c))
 
-static void
-up(int UP)
+static int
+__frame_alloc(frame_t *fr, int rows, int cols)
 {
-	int		i;
+	size_t	ncells = (size_t)rows * (size_t)cols;
 
-	for (i = 0; i < UP; ++i)
-		printf("\e[A");
-}
+	if (!(fr->cells = malloc(ncells)))
+		return -1;
 
-static void
-down(int DOWN)
-{
-	int		i;
+	if (!(fr->attrs = malloc(ncells)))
+	{
+		free(fr->cells);
+		fr->cells = NULL;
+		return -1;
+	}
 
-	for (i = 0; i < DOWN; ++i)
-		printf("\e[B");
-}
+	fr->rows = rows;
+	fr->cols = cols;
 
-static void
-left(int LEFT)
-{
-	int		i;
+	memset(fr->cells, 0x20, ncells);
+	memset(fr->attrs, ATTR_NONE, ncells);
 
-	for (i = 0; i < LEFT; ++i)
-		printf("\e[D");
+	return 0;
 }
 
 static void
-right(int RIGHT)
+__frame_free(frame_t *fr)
 {
-	int		i;
-
-	for (i = 0; i < RIGHT; ++i)
-		printf("\e[C");
+	free(fr->cells);
+	free(fr->attrs);
+	clear_struct(fr);
 }
 
+/*
+ * Append LEN bytes to the output buffer that will be
+ * written out at the end of render_flush().
+ */
 static void
-fill_line(char *colour)
+__render_append(const char *data, size_t len)
 {
-	int		i;
+	if ((RENDER.olen + len) > RENDER.osize)
+	{
+		size_t	new_size = RENDER.osize ? RENDER.osize : 4096;
+		char		*tmp;
+
+		while (new_size < (RENDER.olen + len))
+			new_size <<= 1;
 
-	putchar(0x0d);
-	printf("%s", colour);
-	for (i = 0; i < (WINSIZE.ws_col-1); ++i)
-		putchar(0x20);
-	putchar(0x20);
-	putchar(0x0d);
-	printf("\e[m");
+		if (!(tmp = realloc(RENDER.obuf, new_size)))
+			return;
+
+		RENDER.obuf = tmp;
+		RENDER.osize = new_size;
+	}
+
+	memcpy(RENDER.obuf + RENDER.olen, data, len);
+	RENDER.olen += len;
 }
 
 static void
-fill(void)
+__render_write(const char *buf, size_t len)
 {
-	int		i, j;
+	ssize_t		n;
 
-	up(WINSIZE.ws_row-1);
-	for (i = 0; i < WINSIZE.ws_row; ++i)
+	while (len > 0)
 	{
-		for (j = 0; j < WINSIZE.ws_col; ++j)
-			putchar(0x20);
+		if ((n = write(STDOUT_FILENO, buf, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return;
+		}
 
-		if (i != (WINSIZE.ws_row-1))
-			printf("\r\n");
+		buf += n;
+		len -= (size_t)n;
 	}
 }
 
-/**
- * Display file file permissions and
- * file creation time.
- */
 static void
-print_fileinfo(char *filename)
+__sigwinch_handler(int signo)
 {
-	struct stat		statb;
-	static char			buffer[512];
-	struct tm		*TIME = NULL;
-	mode_t			mode;
-
-	clear_struct(&statb);
-	lstat(filename, &statb);
-	fill_line(FILE_STATS_COLOUR);
-	printf("%s", FILE_STATS_COLOUR);
-	printf("%22s %s\n", "FILENAME", filename);
-	--POSITION;
-	fill_line(FILE_STATS_COLOUR);
-	printf("%s", FILE_STATS_COLOUR);
-	TIME = gmtime(&statb.st_ctime);
-	strftime(buffer, 40, "%A %d %B %Y at %T %Z", TIME);
-	printf("%22s %s\n", "CREATED", buffer);
-	--POSITION;
-	fill_line(FILE_STATS_COLOUR);
-	printf("%s", FILE_STATS_COLOUR);
-	printf("%22s ", "PERMISSIONS");
-	mode = statb.st_mode;
-	printf("-");
-
-	if (S_IRUSR & mode)
-		printf("r");
-	else
-		printf("-");
-
-	if (S_IWUSR & mode)
-		printf("w");
-	else
-		printf("-");
-
-	if (S_IXUSR & mode && !(S_ISUID & mode))
-		printf("x");
-	else if (!(S_IXUSR & mode) && S_ISUID & mode)
-		printf("S");
-	else if (S_IXUSR & mode && S_ISUID & mode)
-		printf("s");
-	else
-		printf("-");
-
-	if (S_IRGRP & mode)
-		printf("r");
-	else
-		printf("-");
+	WINCH_PENDING = 1;
+}
 
-	if (S_IWGRP & mode)
-		printf("w");
-	else
-		printf("-");
+/**
+ * Set up the frames for the current terminal window. If stdout
+ * is not a terminal then the renderer is disabled and all of
+ * the render_*() functions do nothing.
+ */
+static int
+render_init(void)
+{
+	struct sigaction	sa;
 
-	if (S_IXGRP & mode && !(S_ISGID & mode))
-		printf("x");
-	else if (S_IXGRP & mode && S_ISGID & mode)
-		printf("s");
-	else if (!(S_IXGRP & mode) && S_ISGID & mode)
-		printf("S");
-	else
-		printf("-");
+	clear_struct(&RENDER);
 
-	if (S_IROTH & mode)
-		printf("r");
-	else
-		printf("-");
+	if (!isatty(STDOUT_FILENO))
+		return 0;
 
-	if (S_IWOTH & mode)
-		printf("w");
-	else
-		printf("-");
+	clear_struct(&WINSIZE);
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &WINSIZE) < 0 || !WINSIZE.ws_row || !WINSIZE.ws_col)
+		return 0;
 
-	if (S_IXOTH & mode)
-		printf("x");
-	else
-		printf("-");
+	if (__frame_alloc(&RENDER.front, WINSIZE.ws_row, WINSIZE.ws_col) < 0
+	|| __frame_alloc(&RENDER.back, WINSIZE.ws_row, WINSIZE.ws_col) < 0)
+	{
+		fprintf(stderr, "render_init: failed to allocate frames (%s)\n", strerror(errno));
+		__frame_free(&RENDER.front);
+		__frame_free(&RENDER.back);
+		return -1;
+	}
 
-	putchar(0x0a);
+	RENDER.enabled = 1;
+	RENDER.full_redraw = 1;
 
-	--POSITION;
-	fill_line(FILE_STATS_COLOUR);
-	printf("%s", FILE_STATS_COLOUR);
-	printf("%22s %lu bytes\n", "FILE SIZE", statb.st_size);
-	--POSITION;
-	fill_line(FILE_STATS_COLOUR);
-	printf("%s", FILE_STATS_COLOUR);
-	int	page_size = sysconf(_SC_PAGESIZE);
-	printf("%22s %lu + %lu bytes (system page size=%d)\n", "TOTAL PAGES", statb.st_size / page_size, statb.st_size % page_size, page_size);
-	--POSITION;
+	clear_struct(&sa);
+	sa.sa_handler = __sigwinch_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, NULL);
 
-	printf("%s", END_COL);
+	/*
+	 * Hide the cursor while we are drawing.
+	 */
+	__render_write("\x1b[?25l", 6);
 
-	return;
+	return 0;
 }
 
 /**
- * Displays progress bars of the current formatting operation.
- * @arg - the string identifying the current operation.
+ * Called from the progress thread after a SIGWINCH. The old
+ * contents of the window will have been reflowed by the
+ * terminal, so clear it and redraw everything.
  */
-static void *
-show_progress(void *arg)
+static void
+render_resize(void)
 {
-	size_t		len;
-	size_t		to_print;
-	double		float_current_progress;
-	double		period;
-	double		min;
-	double		delta_ceil;
-	double		delta_floor;
-	unsigned	current_progress;
+	struct winsize	ws;
 
-	len = strlen((char *)arg);
-	to_print = (WINSIZE.ws_col-len-4);
+	if (!RENDER.enabled)
+		return;
 
-	/*
-	 * If 100 blocks make up the 100% bar, single progress
-	 * block is worth 1% of the lines in the file. If 182
-	 * blocks, single progress block is worth 0.5495% of the
-	 * lines in the file. If 50 blocks, single progress block
-	 * is worth 2% of the lines in the file.
-	 */
+	clear_struct(&ws);
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || !ws.ws_row || !ws.ws_col)
+		return;
 
-	period = ((double)100 / (double)to_print);
-	min = period;
+	WINSIZE = ws;
 
-	fprintf(stderr, "%s%s%s", DISPLAY_COLOUR, (char *)arg, END_COL);
+	__frame_free(&RENDER.front);
+	__frame_free(&RENDER.back);
 
-	for (;;)
+	if (__frame_alloc(&RENDER.front, WINSIZE.ws_row, WINSIZE.ws_col) < 0
+	|| __frame_alloc(&RENDER.back, WINSIZE.ws_row, WINSIZE.ws_col) < 0)
 	{
-		while(1)
-		{
-			float_current_progress = ((double)global_data.done_lines / (double)global_data.total_lines) * 100;
-			if (float_current_progress >= min)
-				break;
-		}
-
-		/*
-		 * Are we nearer the ceiling or the floor?
-		 */
-		delta_ceil = (double)ceil(float_current_progress) - float_current_progress;
-		delta_floor = float_current_progress - (double)floor(float_current_progress);
-
-		if (delta_ceil <= delta_floor)
-			current_progress = (unsigned)ceil(float_current_progress);
-		else
-			current_progress = (unsigned)floor(float_current_progress);
-
-		while (min < float_current_progress)
-		{
-			fprintf(stderr, "%s%c%s", PROGRESS_COLOUR, 0x23, END_COL);
-			min += period;
-			--to_print;
-		}
-
-		right(to_print);
-		fprintf(stderr, "%s%3u%%%s", DISPLAY_COLOUR, current_progress, END_COL);
-		left(to_print+3);
-
-		if (current_progress >= 100)
-			break;
+		__frame_free(&RENDER.front);
+		__frame_free(&RENDER.back);
+		RENDER.enabled = 0;
+		return;
 	}
 
-	fprintf(stderr, "%s\n", END_COL);
-	pthread_exit((void *)0);
+	RENDER.full_redraw = 1;
+	__render_write("\x1b[2J", 4);
 }
 
-/*
- * Remove a byte range from the file and vma by taking the data
- * from [STARTP+OFFSET+RANGE,ENDP) and moving it to
- * [STARTP+OFFSET,ENDP-RANGE). Data from [ENDP-RANGE,ENDP)
- * is zeroed out and then the vma is adjusted to be
- * [STARTP,ENDP-RANGE). File is then truncated. The dirty page(s)
- * in the vma will be written back to disc later by the kernel.
+/**
+ * Put the cursor back below the frame and release the frames.
  */
-static int
-__collapse_file(mapped_file_t *f, off_t offset, size_t range)
+static void
+render_finish(void)
 {
-	assert(f);
-
-	if (offset < 0 || offset >= f->map_size)
-		return 0;
-
-	char	*to = ((char *)f->startp + offset);
-	char	*from = (to + range);
-	char	*endp = ((char *)f->endp);
-	int		flags;
-	size_t	map_size = f->map_size;
+	char	seq[32];
+	int		len;
 
-	memmove(to, from, (endp - from));
-	to = (endp - range);
-	memset(to, 0, range);
+	if (!RENDER.enabled)
+		return;
 
-	flags = 0;
-	f->flags = flags = (MAP_SHARED|MAP_FIXED);
-	f->map_size = (map_size -= range);
+	len = snprintf(seq, sizeof(seq), "%s\x1b[%d;1H\n\x1b[?25h", END_COL, RENDER.front.rows);
+	__render_write(seq, (size_t)len);
 
-	if ((f->startp = mmap(f->startp, map_size, PROT_READ|PROT_WRITE, flags, f->fd, 0)) == MAP_FAILED)
-	{
-		fprintf(stderr, "__collapse_file: mmap error (%s)\n", strerror(errno));
-		return -1;
-	}
+	__frame_free(&RENDER.front);
+	__frame_free(&RENDER.back);
+	free(RENDER.obuf);
+	clear_struct(&RENDER);
+}
 
-	f->endp = ((char *)f->startp + map_size);
+/**
+ * Blank the whole frame with attribute ATTR.
+ */
+static void
+render_clear(int attr)
+{
+	size_t	ncells;
 
-	if (ftruncate(f->fd, f->current_file_size -= range) < 0)
-	{
-		fprintf(stderr, "__collapse_file: ftruncate error (%s)\n", strerror(errno));
-		return -1;
-	}
+	if (!RENDER.enabled)
+		return;
 
-	return 0;
+	ncells = (size_t)RENDER.back.rows * (size_t)RENDER.back.cols;
+	memset(RENDER.back.cells, 0x20, ncells);
+	memset(RENDER.back.attrs, attr, ncells);
 }
 
-/*
- * Allocate BY bytes of disc space at the end of the file and
- * update the vma accordingly. We ask the kernel to keep the
- * vma at the same start address with MAP_FIXED, because we'd
- * like to be efficient and not needlessly copy the entire
- * vma to another location...
+/**
+ * Blank a single row of the frame with attribute ATTR.
  */
-static void *
-__extend_file_and_map(mapped_file_t *f, off_t by)
+static void
+render_fill_line(int row, int attr)
 {
-	assert(f);
+	frame_t	*fr = &RENDER.back;
 
-	size_t	map_size = f->map_size;
-	int			flags = f->flags;
-	
-	if (by <= 0)
-		return f->startp;
+	if (!RENDER.enabled || row < 0 || row >= fr->rows)
+		return;
 
-	if (posix_fallocate(f->fd, (size_t)((char *)f->endp - (char *)f->startp), (size_t)by) < 0)
-	{
-		fprintf(stderr, "__extend_file_and_map: posix_fallocate error (%s)\n", strerror(errno));
-		return NULL;
-	}
+	memset(fr->cells + cell_index(fr, row, 0), 0x20, fr->cols);
+	memset(fr->attrs + cell_index(fr, row, 0), attr, fr->cols);
+}
 
-	f->current_file_size += (size_t)by;
+/**
+ * Write LEN bytes of STR into the frame at ROW, COL, clipping
+ * anything that falls outside of the window.
+ */
+static void
+render_put(int row, int col, int attr, const char *str, size_t len)
+{
+	frame_t	*fr = &RENDER.back;
 
-	map_size += by;
-	f->flags = (flags |= MAP_FIXED);
+	if (!RENDER.enabled || row < 0 || row >= fr->rows || col >= fr->cols)
+		return;
 
-	if ((f->startp = mmap(f->startp, map_size, PROT_READ|PROT_WRITE, flags, f->fd, 0)) == MAP_FAILED)
+	if (col < 0)
 	{
-		fprintf(stderr, "__extend_file_and_map: mmap error (%s)\n", strerror(errno));
-		return NULL;
+		if ((size_t)-col >= len)
+			return;
+
+		str += -col;
+		len -= (size_t)-col;
+		col = 0;
 	}
 
-	f->map_size = map_size;
-	f->endp = ((char *)f->startp + map_size);
+	if (len > (size_t)(fr->cols - col))
+		len = (size_t)(fr->cols - col);
 
-	return f->startp;
+	memcpy(fr->cells + cell_index(fr, row, col), str, len);
+	memset(fr->attrs + cell_index(fr, row, col), attr, len);
 }
 
-/*
- * Shift the data from [STARTP+OFFSET,ENDP) to [STARTP+OFFSET+BY,ENDP+BY).
- * User should have already called __extend_file_and_map() so that
- * there is enough disc space and bytes at end of vma for the shift.
- * F->ENDP will be pointing BY bytes pas the old end. So what we want
- * here is to shift the range [FROM,ENDP-BY) to [TO,ENDP).
- * Data in [FROM,TO) is zeroed out.
+/**
+ * Fill LEN cells at ROW, COL with the character C.
  */
 static void
-__shift_file_data(mapped_file_t *f, off_t offset, size_t by)
+render_repeat(int row, int col, int attr, char c, int len)
 {
-	assert(f);
+	frame_t	*fr = &RENDER.back;
 
-	char	*from = ((char *)f->startp + offset);
-	char	*to = ((char *)from + by);
-	char	*endp = ((char *)f->endp - by);
-	size_t	bytes;
-	
-	bytes = (endp - from);
-	memmove((void *)to, (void *)from, bytes);
-	memset(from, 0, by);
+	if (!RENDER.enabled || row < 0 || row >= fr->rows || col < 0 || col >= fr->cols || len <= 0)
+		return;
 
-	return;
+	if (len > (fr->cols - col))
+		len = (fr->cols - col);
+
+	memset(fr->cells + cell_index(fr, row, col), c, len);
+	memset(fr->attrs + cell_index(fr, row, col), attr, len);
 }
 
-int
-__do_line_count(mapped_file_t *f)
+/**
+ * Diff the composed frame against what is on the screen and
+ * emit only the changed span of each row, all in one write(2).
+ */
+static void
+render_flush(void)
 {
-	assert(f);
+	frame_t	*back = &RENDER.back;
+	frame_t	*front = &RENDER.front;
+	char		seq[32];
+	int			row;
+	int			first;
+	int			last;
+	int			col;
+	int			attr;
+	int			len;
+	size_t	idx;
+
+	if (!RENDER.enabled)
+		return;
 
-	char	*p = (char *)f->startp;
-	char	*endp = (char *)f->endp;
-	int		lines = 0;
+	RENDER.olen = 0;
 
-	while (p < endp)
+	for (row = 0; row < back->rows; ++row)
 	{
-		if (*p == 0x0a)
+		idx = cell_index(back, row, 0);
+
+		if (RENDER.full_redraw)
+		{
+			first = 0;
+			last = back->cols - 1;
+		}
+		else
+		{
+			for (first = 0; first < back->cols; ++first)
+			{
+				if (back->cells[idx+first] != front->cells[idx+first]
+				|| back->attrs[idx+first] != front->attrs[idx+first])
+					break;
+			}
+
+			if (first == back->cols)
+				continue;
+
+			for (last = back->cols - 1; last > first; --last)
+			{
+				if (back->cells[idx+last] != front->cells[idx+last]
+				|| back->attrs[idx+last] != front->attrs[idx+last])
+					break;
+			}
+		}
+
+		len = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row + 1, first + 1);
+		__render_append(seq, (size_t)len);
+
+		attr = -1;
+		col = first;
+
+		while (col <= last)
+		{
+			int		run = col;
+
+			if (back->attrs[idx+col] != attr)
+			{
+				attr = back->attrs[idx+col];
+				__render_append(END_COL, strlen(END_COL));
+				if (attr != ATTR_NONE)
+					__render_append(attr_colours[attr], strlen(attr_colours[attr]));
+			}
+
+			while (run <= last && back->attrs[idx+run] == attr)
+				++run;
+
+			__render_append(back->cells + idx + col, (size_t)(run - col));
+			col = run;
+		}
+
+		memcpy(front->cells + idx + first, back->cells + idx + first, (size_t)(last - first + 1));
+		memcpy(front->attrs + idx + first, back->attrs + idx + first, (size_t)(last - first + 1));
+	}
+
+	RENDER.full_redraw = 0;
+
+	if (!RENDER.olen)
+		return;
+
+	__render_append(END_COL, strlen(END_COL));
+	__render_write(RENDER.obuf, RENDER.olen);
+}
+
+/*
+ * The file information is formatted once and then redrawn
+ * from here on every refresh, so that it survives the
+ * frame being resized.
+ */
+#define FILEINFO_ROWS		5
+static char	FILEINFO[FILEINFO_ROWS][512];
+
+/*
+ * State of each progress bar that is shown, so that the
+ * whole UI can be recomposed on every refresh. With a
+ * single file we show one bar per phase, as they happen;
+ * with several files we show one bar per worker and an
+ * overall bar.
+ */
+#define MAX_BARS		8
+
+typedef struct progress_bar_t
+{
+	char			label[128];
+	double		percent;
+	double		rate;				/* bytes per second */
+	double		line_rate;	/* lines per second */
+	double		eta;				/* seconds, -1 if not known yet */
+	uint64_t	start_ns;
+	uint64_t	prev_ns;
+	size_t		prev_bytes;
+	size_t		prev_lines;
+	int				samples;
+	int				done;
+} progress_bar_t;
+
+static progress_bar_t	BARS[MAX_BARS];
+static int	NR_BARS;
+static progress_bar_t	WORKER_BARS[MAX_WORKERS];
+static progress_bar_t	OVERALL_BAR;
+static int	FILES_DONE;
+static int	FILES_FAILED;
+
+static const char	*phase_labels[NR_PHASE_TYPES] =
+{
+	"",
+	STR_PROGRESS_NORMALISE,
+	STR_PROGRESS_LENGTH,
+	STR_PROGRESS_JUSTIFY,
+	STR_PROGRESS_UNJUSTIFY,
+	STR_PROGRESS_LALIGN,
+	STR_PROGRESS_RALIGN,
+	STR_PROGRESS_CALIGN,
+	STR_PROGRESS_FOLD
+};
+
+/*
+ * For machine-readable output.
+ */
+static const char	*phase_names[NR_PHASE_TYPES] =
+{
+	"idle",
+	"normalise",
+	"length",
+	"justify",
+	"unjustify",
+	"lalign",
+	"ralign",
+	"calign",
+	"fold"
+};
+
+#define dashboard_mode() (NR_JOBS > 1)
+
+static void
+__format_count(char *buf, size_t size, double v)
+{
+	if (v >= 1e9)
+		snprintf(buf, size, "%.2fG", v / 1e9);
+	else
+	if (v >= 1e6)
+		snprintf(buf, size, "%.2fM", v / 1e6);
+	else
+	if (v >= 1e3)
+		snprintf(buf, size, "%.2fk", v / 1e3);
+	else
+		snprintf(buf, size, "%.0f", v);
+}
+
+static void
+__format_eta(char *buf, size_t size, double eta)
+{
+	unsigned long	secs;
+
+	if (eta < 0)
+	{
+		snprintf(buf, size, "--:--:--");
+		return;
+	}
+
+	secs = (unsigned long)(eta + 0.5);
+	snprintf(buf, size, "%02lu:%02lu:%02lu", secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+/**
+ * Lay out a progress bar for the current width of the
+ * frame: label, bar, percentage, throughput and ETA. The
+ * statistics are dropped if the window is too narrow.
+ */
+static void
+__draw_bar(int row, progress_bar_t *bar)
+{
+	char			stats[128];
+	char			line_rate[32];
+	char			eta[32];
+	int				cols = RENDER.back.cols;
+	int				len;
+	int				stats_len;
+	int				width;
+	int				blocks;
+	unsigned	percent;
+
+	percent = (unsigned)(bar->percent + 0.5);
+	if (percent > 100)
+		percent = 100;
+
+	__format_count(line_rate, sizeof(line_rate), bar->line_rate);
+	__format_eta(eta, sizeof(eta), bar->eta);
+
+	stats_len = snprintf(stats, sizeof(stats), " %3u%% %8.1f MB/s %8s lines/s ETA %s ",
+		percent, bar->rate / 1e6, line_rate, eta);
+
+	len = (int)strlen(bar->label);
+	width = (cols - len - stats_len);
+
+	if (width < 10)
+	{
+		stats_len = snprintf(stats, sizeof(stats), "%3u%%", percent);
+		width = (cols - len - stats_len);
+	}
+
+	render_put(row, 0, ATTR_DISPLAY, bar->label, (size_t)len);
+
+	if (width > 0)
+	{
+		blocks = (int)(((double)width * bar->percent) / 100);
+		if (blocks > width)
+			blocks = width;
+
+		render_repeat(row, len, ATTR_PROGRESS, 0x23, blocks);
+	}
+	else
+	{
+		width = 0;
+	}
+
+	render_put(row, len + width, ATTR_DISPLAY, stats, (size_t)stats_len);
+}
+
+/**
+ * Compose the whole UI into the back frame, at the bottom
+ * of the window: either the file information followed by
+ * the bar for each phase, or a bar for each worker and the
+ * overall bar.
+ */
+static void
+__draw_ui(void)
+{
+	int		row;
+	int		rows = RENDER.back.rows;
+	int		i;
+
+	if (!RENDER.enabled)
+		return;
+
+	render_clear(ATTR_NONE);
+
+	if (dashboard_mode())
+	{
+		row = rows - (NR_WORKERS + 1);
+		i = 0;
+
+		/*
+		 * Not enough room for every worker;
+		 * the overall bar always gets a row.
+		 */
+		if (row < 0)
+		{
+			i = -row;
+			row = 0;
+		}
+
+		for (; i < NR_WORKERS; ++i, ++row)
+			__draw_bar(row, &WORKER_BARS[i]);
+
+		__draw_bar(rows - 1, &OVERALL_BAR);
+		return;
+	}
+
+	row = rows - (FILEINFO_ROWS + (NR_BARS > 3 ? NR_BARS : 3));
+	if (row < 0)
+		row = 0;
+
+	for (i = 0; i < FILEINFO_ROWS; ++i, ++row)
+	{
+		render_fill_line(row, ATTR_STATS);
+		render_put(row, 0, ATTR_STATS, FILEINFO[i], strlen(FILEINFO[i]));
+	}
+
+	for (i = 0; i < NR_BARS; ++i, ++row)
+		__draw_bar(row, &BARS[i]);
+}
+
+/**
+ * Display file file permissions and
+ * file creation time.
+ */
+static void
+print_fileinfo(char *filename)
+{
+	struct stat		statb;
+	static char			buffer[64];
+	struct tm		*TIME = NULL;
+	mode_t			mode;
+	char				perms[11];
+	int					page_size;
+
+	clear_struct(&statb);
+	lstat(filename, &statb);
+
+	snprintf(FILEINFO[0], sizeof(FILEINFO[0]), "%22s %s", "FILENAME", filename);
+
+	TIME = gmtime(&statb.st_ctime);
+	strftime(buffer, sizeof(buffer), "%A %d %B %Y at %T %Z", TIME);
+	snprintf(FILEINFO[1], sizeof(FILEINFO[1]), "%22s %s", "CREATED", buffer);
+
+	mode = statb.st_mode;
+
+	perms[0] = '-';
+	perms[1] = (S_IRUSR & mode) ? 'r' : '-';
+	perms[2] = (S_IWUSR & mode) ? 'w' : '-';
+
+	if (S_IXUSR & mode && !(S_ISUID & mode))
+		perms[3] = 'x';
+	else if (!(S_IXUSR & mode) && S_ISUID & mode)
+		perms[3] = 'S';
+	else if (S_IXUSR & mode && S_ISUID & mode)
+		perms[3] = 's';
+	else
+		perms[3] = '-';
+
+	perms[4] = (S_IRGRP & mode) ? 'r' : '-';
+	perms[5] = (S_IWGRP & mode) ? 'w' : '-';
+
+	if (S_IXGRP & mode && !(S_ISGID & mode))
+		perms[6] = 'x';
+	else if (S_IXGRP & mode && S_ISGID & mode)
+		perms[6] = 's';
+	else if (!(S_IXGRP & mode) && S_ISGID & mode)
+		perms[6] = 'S';
+	else
+		perms[6] = '-';
+
+	perms[7] = (S_IROTH & mode) ? 'r' : '-';
+	perms[8] = (S_IWOTH & mode) ? 'w' : '-';
+	perms[9] = (S_IXOTH & mode) ? 'x' : '-';
+	perms[10] = 0;
+
+	snprintf(FILEINFO[2], sizeof(FILEINFO[2]), "%22s %s", "PERMISSIONS", perms);
+	snprintf(FILEINFO[3], sizeof(FILEINFO[3]), "%22s %lu bytes", "FILE SIZE", statb.st_size);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	snprintf(FILEINFO[4], sizeof(FILEINFO[4]), "%22s %lu + %lu bytes (system page size=%d)",
+		"TOTAL PAGES", statb.st_size / page_size, statb.st_size % page_size, page_size);
+
+	__draw_ui();
+	render_flush();
+
+	return;
+}
+
+static uint64_t
+__now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Hardware performance counters (--perf-counters). Each worker
+ * opens its own set of counters on itself when it starts and
+ * reads them at the start and end of every phase; the difference
+ * is added to the totals for that type of phase.
+ */
+#define NR_PERF_COUNTERS	5
+
+#define __hw_cache(c)																\
+	((c) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct
+{
+	const char	*name;
+	uint32_t		type;
+	uint64_t		config;
+} perf_events[NR_PERF_COUNTERS] =
+{
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "LLC-misses", PERF_TYPE_HW_CACHE, __hw_cache(PERF_COUNT_HW_CACHE_LL) },
+	{ "dTLB-misses", PERF_TYPE_HW_CACHE, __hw_cache(PERF_COUNT_HW_CACHE_DTLB) }
+};
+
+static int			SHOW_STATS;				/* --stats */
+static int			PERF_COUNTERS;		/* --perf-counters */
+static int			PERF_OPENED[NR_PERF_COUNTERS];
+static int			PERF_WARNED[NR_PERF_COUNTERS];
+static uint64_t	PERF_TOTALS[NR_PHASE_TYPES][NR_PERF_COUNTERS];
+static __thread int				PERF_FDS[NR_PERF_COUNTERS];
+static __thread uint64_t	PERF_START[NR_PERF_COUNTERS];
+
+/**
+ * Open the counters for the calling thread. The counters are
+ * inherited by any threads it goes on to create. A counter that
+ * the kernel will not give us (no PMU in a VM, perf_event_paranoid,
+ * ...) is left out with a warning rather than stopping the run.
+ */
+static void
+perf_open(void)
+{
+	struct perf_event_attr	attr;
+	int		i;
+	int		fd;
+
+	for (i = 0; i < NR_PERF_COUNTERS; ++i)
+	{
+		PERF_FDS[i] = -1;
+
+		if (!PERF_COUNTERS)
+			continue;
+
+		clear_struct(&attr);
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		if ((fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) < 0)
+		{
+			if (!__atomic_exchange_n(&PERF_WARNED[i], 1, __ATOMIC_RELAXED))
+				fprintf(stderr, "perf_open: %s not available (%s)\n", perf_events[i].name, strerror(errno));
+			continue;
+		}
+
+		PERF_FDS[i] = fd;
+		__atomic_store_n(&PERF_OPENED[i], 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+perf_close(void)
+{
+	int		i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; ++i)
+	{
+		if (PERF_FDS[i] != -1)
+			close(PERF_FDS[i]);
+		PERF_FDS[i] = -1;
+	}
+}
+
+/**
+ * Read a counter, scaled up for any time the kernel
+ * had it switched out to share the PMU.
+ */
+static uint64_t
+__perf_read(int fd)
+{
+	uint64_t	v[3];
+
+	if (read(fd, v, sizeof(v)) != (ssize_t)sizeof(v) || !v[2])
+		return 0;
+
+	if (v[2] < v[1])
+		return (uint64_t)((double)v[0] * ((double)v[1] / (double)v[2]));
+
+	return v[0];
+}
+
+static void
+perf_begin_phase(void)
+{
+	int		i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; ++i)
+	{
+		if (PERF_FDS[i] != -1)
+			PERF_START[i] = __perf_read(PERF_FDS[i]);
+	}
+}
+
+static void
+perf_end_phase(int phase)
+{
+	uint64_t	now;
+	int				i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; ++i)
+	{
+		if (PERF_FDS[i] == -1)
+			continue;
+
+		now = __perf_read(PERF_FDS[i]);
+		if (now > PERF_START[i])
+			__atomic_fetch_add(&PERF_TOTALS[phase][i], now - PERF_START[i], __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Syscall and memmove accounting ('make ACCOUNTING=1'). The file
+ * editing code calls mmap(), mremap(), ftruncate(), posix_fallocate()
+ * and memmove() through wrappers that count them against the phase
+ * the calling worker is in. With --check-bounds every phase of every
+ * file is checked against acct_bounds[] once it is finished, so that
+ * quadratic behaviour cannot quietly creep back in.
+ */
+#define ACCT_MMAP						0
+#define ACCT_MREMAP					1
+#define ACCT_FTRUNCATE			2
+#define ACCT_FALLOCATE			3
+#define ACCT_MEMMOVE				4
+#define ACCT_MEMMOVE_BYTES	5
+#define NR_ACCT							6
+
+static int			CHECK_BOUNDS;		/* --check-bounds */
+
+#ifdef ACCOUNTING
+static const char	*acct_names[NR_ACCT] =
+{
+	"mmap",
+	"mremap",
+	"ftruncate",
+	"fallocate",
+	"memmove",
+	"moved"
+};
+
+/*
+ * What a phase may cost on a file of N bytes (before or after
+ * the phase, whichever is more): at most
+ * SYSCALLS + LOG_SYSCALLS * log2(N) calls that map or resize
+ * the file, and at most MEMMOVE * N bytes moved about by
+ * memmove(). A phase with a negative MEMMOVE is not checked.
+ * GROWS marks the phases that write through a sink, which
+ * can grow its gap (the normaliser only does with --checkpoint).
+ */
+static const struct
+{
+	double	syscalls;
+	double	log_syscalls;
+	double	memmove;
+	int			grows;
+} acct_bounds[NR_PHASE_TYPES] =
+{
+	{ 2, 0, 0, 0 },		/* map + unmap */
+	{ 2, 0, 2, 1 },		/* normalise (trim, then the hyphen join) */
+	{ 2, 6, 8, 1 },		/* length */
+	{ 2, 6, 8, 1 },		/* justify */
+	{ 2, 0, 1, 0 },		/* unjustify */
+	{ 2, 0, 1, 0 },		/* lalign */
+	{ 2, 6, 8, 1 },		/* ralign */
+	{ 2, 6, 8, 1 },		/* calign */
+	{ 2, 0, 1, 0 }		/* fold */
+};
+
+static uint64_t	ACCT_TOTALS[NR_PHASE_TYPES][NR_ACCT];
+static int			ACCT_VIOLATIONS;
+static __thread uint64_t	ACCT[NR_ACCT];
+static __thread size_t		ACCT_OUTPUT;	/* size of the file after the phase */
+
+# define acct_output(n) (ACCT_OUTPUT = (n))
+
+static void *
+__acct_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+	++ACCT[ACCT_MMAP];
+	return mmap(addr, len, prot, flags, fd, off);
+}
+
+static void *
+__acct_mremap(void *old, size_t old_size, size_t new_size, int flags)
+{
+	++ACCT[ACCT_MREMAP];
+	return mremap(old, old_size, new_size, flags);
+}
+
+static int
+__acct_ftruncate(int fd, off_t len)
+{
+	++ACCT[ACCT_FTRUNCATE];
+	return ftruncate(fd, len);
+}
+
+static int
+__acct_posix_fallocate(int fd, off_t off, off_t len)
+{
+	++ACCT[ACCT_FALLOCATE];
+	return posix_fallocate(fd, off, len);
+}
+
+static void *
+__acct_memmove(void *to, const void *from, size_t n)
+{
+	++ACCT[ACCT_MEMMOVE];
+	ACCT[ACCT_MEMMOVE_BYTES] += n;
+	return memmove(to, from, n);
+}
+
+/**
+ * Add what the worker has done since the last call to
+ * the totals for PHASE and check it against the bounds
+ * for a phase that started with BYTES bytes.
+ */
+static void
+acct_flush(int phase, size_t bytes)
+{
+	uint64_t	syscalls = ACCT[ACCT_MMAP] + ACCT[ACCT_MREMAP] + ACCT[ACCT_FTRUNCATE] + ACCT[ACCT_FALLOCATE];
+	double		n;
+	int				i;
+
+	if (ACCT_OUTPUT > bytes)
+		bytes = ACCT_OUTPUT;
+
+	ACCT_OUTPUT = 0;
+	n = (double)(bytes > 2 ? bytes : 2);
+
+	for (i = 0; i < NR_ACCT; ++i)
+		__atomic_fetch_add(&ACCT_TOTALS[phase][i], ACCT[i], __ATOMIC_RELAXED);
+
+	if (CHECK_BOUNDS && acct_bounds[phase].memmove >= 0)
+	{
+		double	max_syscalls = acct_bounds[phase].syscalls + acct_bounds[phase].log_syscalls * log2(n);
+		double	max_moved = acct_bounds[phase].memmove * n;
+
+		/*
+		 * With --checkpoint the gap only doubles when it grows,
+		 * so it can grow, and move the tail, O(log N) times.
+		 */
+		if (test_flag(CHECKPOINT) && acct_bounds[phase].grows)
+		{
+			max_syscalls += (4 + 2 * log2(n));
+			max_moved += (n * log2(n));
+		}
+
+		/*
+		 * With --crlf the CRs go in after the last phase: the
+		 * file is extended the once and each byte moved once.
+		 */
+		if (test_flag(CRLF) && phase == PHASE_IDLE)
+		{
+			max_syscalls += 2;
+			max_moved += n;
+		}
+
+		if ((double)syscalls > max_syscalls || (double)ACCT[ACCT_MEMMOVE_BYTES] > max_moved)
+		{
+			fprintf(stderr, "acct_flush: %s: %s phase exceeded its bounds"
+				" (%lu syscalls, at most %.0f; %lu bytes moved, at most %.0f)\n",
+				JOBS[PROGRESS->job].name, phase_names[phase],
+				(unsigned long)syscalls, max_syscalls,
+				(unsigned long)ACCT[ACCT_MEMMOVE_BYTES], max_moved);
+			__atomic_fetch_add(&ACCT_VIOLATIONS, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	memset(ACCT, 0, sizeof(ACCT));
+}
+#else
+# define acct_flush(p, b) do { } while (0)
+# define acct_output(n) do { } while (0)
+#endif
+
+/*
+ * The worker side of the progress slots. Only the worker that
+ * owns a slot writes to it (apart from the ring's TAIL).
+ */
+
+static void
+__push_event(int type, int phase, size_t bytes, size_t lines, size_t extra, int status)
+{
+	progress_slot_t		*slot = PROGRESS;
+	progress_event_t	*ev;
+	unsigned	head = slot->head;
+
+	/*
+	 * If the progress thread has fallen behind, wake it
+	 * up and give it a chance to drain the ring.
+	 */
+	while ((head - __atomic_load_n(&slot->tail, __ATOMIC_ACQUIRE)) >= EVENT_RING_SIZE)
+	{
+		pthread_cond_signal(&PROGRESS_COND);
+		sched_yield();
+	}
+
+	ev = &slot->ring[head & (EVENT_RING_SIZE - 1)];
+	ev->ns = __now_ns();
+	ev->bytes = bytes;
+	ev->lines = lines;
+	ev->extra = extra;
+	ev->job = slot->job;
+	ev->status = (int16_t)status;
+	ev->type = (uint8_t)type;
+	ev->phase = (uint8_t)phase;
+
+	__atomic_store_n(&slot->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+begin_file(int job, size_t bytes)
+{
+	__atomic_store_n(&PROGRESS->job, job, __ATOMIC_RELAXED);
+	__atomic_store_n(&PROGRESS->phase_idx, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&PROGRESS->file_bytes, bytes, __ATOMIC_RELAXED);
+	__push_event(EVENT_FILE_START, PHASE_IDLE, bytes, 0, 0, 0);
+}
+
+static void
+end_file(int status, size_t out_bytes)
+{
+	size_t	bytes = PROGRESS->file_bytes;
+
+	acct_output(out_bytes);
+	acct_flush(PHASE_IDLE, bytes);
+	__atomic_store_n(&PROGRESS->finished_bytes, PROGRESS->finished_bytes + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&PROGRESS->file_bytes, 0, __ATOMIC_RELAXED);
+	__push_event(EVENT_FILE_END, PHASE_IDLE, bytes, 0, out_bytes, status);
+}
+
+static void
+begin_phase(int phase, size_t bytes)
+{
+	progress_update(0, 0);
+	__atomic_store_n(&PROGRESS->phase_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&PROGRESS->phase, phase, __ATOMIC_RELAXED);
+	acct_flush(PHASE_IDLE, PROGRESS->file_bytes);
+	__push_event(EVENT_PHASE_START, phase, bytes, 0, 0, 0);
+	perf_begin_phase();
+}
+
+static void
+end_phase(int status)
+{
+	progress_slot_t	*slot = PROGRESS;
+	size_t	bytes = slot->done_bytes;
+	size_t	lines = slot->done_lines;
+	int			phase = slot->phase;
+
+	perf_end_phase(phase);
+	acct_flush(phase, slot->phase_bytes);
+
+	if (!status)
+		bytes = slot->phase_bytes;
+
+	__atomic_store_n(&slot->work_bytes, slot->work_bytes + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->work_lines, slot->work_lines + lines, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->phase, PHASE_IDLE, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->phase_idx, slot->phase_idx + 1, __ATOMIC_RELAXED);
+	progress_update(0, 0);
+
+	__push_event(EVENT_PHASE_END, phase, bytes, lines, 0, status);
+}
+
+/*
+ * The progress thread side.
+ */
+
+static void
+__sample_bar(progress_bar_t *bar, size_t bytes, size_t lines, double percent, size_t remaining, uint64_t now)
+{
+	double	interval;
+	double	rate;
+	double	line_rate;
+
+	if (bar->prev_ns && now > bar->prev_ns)
+	{
+		interval = ((double)(now - bar->prev_ns) / 1e9);
+		rate = (bytes > bar->prev_bytes ? (double)(bytes - bar->prev_bytes) / interval : 0);
+		line_rate = (lines > bar->prev_lines ? (double)(lines - bar->prev_lines) / interval : 0);
+
+		if (!bar->samples++)
+		{
+			bar->rate = rate;
+			bar->line_rate = line_rate;
+		}
+		else
+		{
+			bar->rate = (PROGRESS_EWMA_ALPHA * rate) + ((1 - PROGRESS_EWMA_ALPHA) * bar->rate);
+			bar->line_rate = (PROGRESS_EWMA_ALPHA * line_rate) + ((1 - PROGRESS_EWMA_ALPHA) * bar->line_rate);
+		}
+	}
+
+	bar->prev_ns = now;
+	bar->prev_bytes = bytes;
+	bar->prev_lines = lines;
+	bar->percent = (percent > 100 ? (double)100 : percent);
+	bar->eta = (bar->rate > 0 ? ((double)remaining / bar->rate) : -1);
+}
+
+/**
+ * Show the average over the whole lifetime of the bar.
+ */
+static void
+__finish_bar(progress_bar_t *bar, size_t bytes, size_t lines, uint64_t now, int status)
+{
+	double	secs = ((double)(now - bar->start_ns) / 1e9);
+
+	if (secs > 0)
+	{
+		bar->rate = ((double)bytes / secs);
+		bar->line_rate = ((double)lines / secs);
+	}
+
+	if (!status)
+		bar->percent = (double)100;
+
+	bar->eta = 0;
+	bar->done = 1;
+}
+
+/*
+ * Time spent in each type of phase, summed over all the
+ * workers. Only ever touched by the progress thread.
+ */
+static uint64_t	FILE_START_NS[MAX_WORKERS];
+static uint64_t	PHASE_START_NS[MAX_WORKERS];
+static uint64_t	PHASE_TOTAL_NS[NR_PHASE_TYPES];
+static size_t		PHASE_TOTAL_BYTES[NR_PHASE_TYPES];
+static size_t		PHASE_TOTAL_LINES[NR_PHASE_TYPES];
+static int			PHASE_COUNT[NR_PHASE_TYPES];
+
+/*
+ * Machine-readable events for --progress-fd. These are
+ * only ever written by the progress thread, so none of
+ * the formatting work has to format strings.
+ */
+static FILE			*EVENT_FP;
+
+#define __event_secs(ns) ((double)((ns) - START_NS) / 1e9)
+
+static void
+__json_string(FILE *fp, const char *str)
+{
+	unsigned char	c;
+
+	fputc(0x22, fp);
+
+	while ((c = (unsigned char)*str++))
+	{
+		if (c == 0x22 || c == 0x5c)
+			fprintf(fp, "\\%c", c);
+		else
+		if (c < 0x20 || c == 0x7f)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+
+	fputc(0x22, fp);
+}
+
+static void
+__emit_event(int worker, progress_event_t *ev)
+{
+	double	secs;
+
+	switch(ev->type)
+	{
+		case EVENT_FILE_START:
+			fprintf(EVENT_FP, "{\"event\":\"file_start\",\"t\":%.6f,\"worker\":%d,\"job\":%d,\"file\":",
+				__event_secs(ev->ns), worker, ev->job);
+			__json_string(EVENT_FP, JOBS[ev->job].name);
+			fprintf(EVENT_FP, ",\"bytes\":%zu}\n", ev->bytes);
+			break;
+
+		case EVENT_FILE_END:
+			secs = ((double)(ev->ns - FILE_START_NS[worker]) / 1e9);
+			fprintf(EVENT_FP, "{\"event\":\"file_end\",\"t\":%.6f,\"worker\":%d,\"job\":%d,\"file\":",
+				__event_secs(ev->ns), worker, ev->job);
+			__json_string(EVENT_FP, JOBS[ev->job].name);
+			fprintf(EVENT_FP, ",\"status\":%s,\"seconds\":%.6f,\"bytes_in\":%zu,\"bytes_out\":%zu}\n",
+				ev->status ? "\"failed\"" : "\"ok\"", secs, ev->bytes, ev->extra);
+			break;
+
+		case EVENT_PHASE_START:
+			fprintf(EVENT_FP, "{\"event\":\"phase_start\",\"t\":%.6f,\"worker\":%d,\"job\":%d,\"phase\":\"%s\",\"bytes\":%zu}\n",
+				__event_secs(ev->ns), worker, ev->job, phase_names[ev->phase], ev->bytes);
+			break;
+
+		case EVENT_PHASE_END:
+			secs = ((double)(ev->ns - PHASE_START_NS[worker]) / 1e9);
+			fprintf(EVENT_FP, "{\"event\":\"phase_end\",\"t\":%.6f,\"worker\":%d,\"job\":%d,\"phase\":\"%s\","
+				"\"status\":%s,\"seconds\":%.6f,\"bytes\":%zu,\"lines\":%zu}\n",
+				__event_secs(ev->ns), worker, ev->job, phase_names[ev->phase],
+				ev->status ? "\"failed\"" : "\"ok\"", secs, ev->bytes, ev->lines);
+			break;
+	}
+}
+
+static void
+__emit_progress(uint64_t now)
+{
+	fprintf(EVENT_FP, "{\"event\":\"progress\",\"t\":%.6f,\"bytes\":%zu,\"total_bytes\":%zu,\"lines\":%zu,"
+		"\"percent\":%.2f,\"rate\":%.0f,\"eta\":%.1f,\"files_done\":%d,\"files_failed\":%d}\n",
+		__event_secs(now), OVERALL_BAR.prev_bytes, global_data.total_bytes, OVERALL_BAR.prev_lines,
+		OVERALL_BAR.percent, OVERALL_BAR.rate, OVERALL_BAR.eta, FILES_DONE, FILES_FAILED);
+}
+
+static void
+__emit_summary(uint64_t now)
+{
+	int		i;
+	int		k;
+	int		first = 1;
+
+	fprintf(EVENT_FP, "{\"event\":\"end\",\"t\":%.6f,\"files\":%d,\"files_failed\":%d,\"bytes\":%zu,\"phases\":{",
+		__event_secs(now), NR_JOBS, FILES_FAILED, global_data.total_bytes);
+
+	for (i = PHASE_NORMALISE; i < NR_PHASE_TYPES; ++i)
+	{
+		if (!PHASE_COUNT[i])
+			continue;
+
+		fprintf(EVENT_FP, "%s\"%s\":{\"count\":%d,\"seconds\":%.6f,\"bytes\":%zu",
+			first ? "" : ",", phase_names[i], PHASE_COUNT[i],
+			(double)PHASE_TOTAL_NS[i] / 1e9, PHASE_TOTAL_BYTES[i]);
+		first = 0;
+
+		for (k = 0; k < NR_PERF_COUNTERS; ++k)
+		{
+			if (PERF_OPENED[k])
+				fprintf(EVENT_FP, ",\"%s\":%lu", perf_events[k].name, (unsigned long)PERF_TOTALS[i][k]);
+		}
+
+		fputc(0x7d, EVENT_FP);
+	}
+
+	fprintf(EVENT_FP, "},\"kernels\":\"%s\",\"clones\":\"%s\"}\n", SIMD_LEVEL, clone_level());
+}
+
+static void
+__handle_event(int worker, progress_event_t *ev)
+{
+	progress_bar_t	*bar;
+
+	if (EVENT_FP)
+		__emit_event(worker, ev);
+
+	switch(ev->type)
+	{
+		case EVENT_FILE_START:
+			FILE_START_NS[worker] = ev->ns;
+			break;
+
+		case EVENT_FILE_END:
+			++FILES_DONE;
+			if (ev->status)
+				++FILES_FAILED;
+			break;
+
+		case EVENT_PHASE_START:
+			PHASE_START_NS[worker] = ev->ns;
+
+			if (dashboard_mode() || NR_BARS >= MAX_BARS)
+				break;
+
+			bar = &BARS[NR_BARS++];
+			clear_struct(bar);
+			snprintf(bar->label, sizeof(bar->label), "%s", phase_labels[ev->phase]);
+			bar->start_ns = bar->prev_ns = ev->ns;
+			bar->eta = -1;
+			break;
+
+		case EVENT_PHASE_END:
+			PHASE_TOTAL_NS[ev->phase] += (ev->ns - PHASE_START_NS[worker]);
+			PHASE_TOTAL_BYTES[ev->phase] += ev->bytes;
+			PHASE_TOTAL_LINES[ev->phase] += ev->lines;
+			++PHASE_COUNT[ev->phase];
+
+			if (dashboard_mode() || !NR_BARS)
+				break;
+
+			__finish_bar(&BARS[NR_BARS-1], ev->bytes, ev->lines, ev->ns, ev->status);
+			break;
+	}
+}
+
+/**
+ * Consume everything the workers have published so far.
+ */
+static void
+__drain_events(void)
+{
+	progress_slot_t	*slot;
+	unsigned	tail;
+	unsigned	head;
+	int				i;
+
+	for (i = 0; i < NR_WORKERS; ++i)
+	{
+		slot = &progress_slots[i];
+		tail = slot->tail;
+		head = __atomic_load_n(&slot->head, __ATOMIC_ACQUIRE);
+
+		while (tail != head)
+		{
+			__handle_event(i, &slot->ring[tail & (EVENT_RING_SIZE - 1)]);
+			++tail;
+		}
+
+		__atomic_store_n(&slot->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * How far through its current file a worker is, as a
+ * fraction of all of the phases the file goes through.
+ */
+static double
+__file_fraction(progress_slot_t *slot)
+{
+	size_t	done = __atomic_load_n(&slot->done_bytes, __ATOMIC_RELAXED);
+	size_t	total = __atomic_load_n(&slot->phase_bytes, __ATOMIC_RELAXED);
+	int			phase = __atomic_load_n(&slot->phase, __ATOMIC_RELAXED);
+	double	frac = (double)__atomic_load_n(&slot->phase_idx, __ATOMIC_RELAXED);
+
+	if (phase != PHASE_IDLE && total)
+		frac += ((double)done / (double)total);
+
+	frac /= (double)NR_PHASES;
+
+	return (frac > 1 ? 1 : frac);
+}
+
+static void
+__sample_progress(uint64_t now)
+{
+	progress_slot_t	*slot;
+	progress_bar_t	*bar;
+	size_t	file_bytes;
+	size_t	done;
+	size_t	lines;
+	size_t	all_done = 0;
+	size_t	all_lines = 0;
+	double	frac;
+	int			phase;
+	int			i;
+
+	for (i = 0; i < NR_WORKERS; ++i)
+	{
+		slot = &progress_slots[i];
+		file_bytes = __atomic_load_n(&slot->file_bytes, __ATOMIC_RELAXED);
+		frac = __file_fraction(slot);
+
+		/*
+		 * Work is measured in bytes of the files that have been
+		 * completely formatted, plus the same for the fraction
+		 * of the current file.
+		 */
+		done = __atomic_load_n(&slot->finished_bytes, __ATOMIC_RELAXED) + (size_t)(frac * (double)file_bytes);
+		lines = __atomic_load_n(&slot->work_lines, __ATOMIC_RELAXED) + __atomic_load_n(&slot->done_lines, __ATOMIC_RELAXED);
+
+		all_done += done;
+		all_lines += lines;
+
+		if (!dashboard_mode())
+		{
+			if (NR_BARS && !BARS[NR_BARS-1].done)
+			{
+				size_t	phase_done = __atomic_load_n(&slot->done_bytes, __ATOMIC_RELAXED);
+				size_t	phase_total = __atomic_load_n(&slot->phase_bytes, __ATOMIC_RELAXED);
+
+				bar = &BARS[NR_BARS-1];
+				__sample_bar(bar, phase_done, __atomic_load_n(&slot->done_lines, __ATOMIC_RELAXED),
+					phase_total ? ((double)phase_done / (double)phase_total) * 100 : 0,
+					phase_total > phase_done ? phase_total - phase_done : 0, now);
+			}
+
+			continue;
+		}
+
+		bar = &WORKER_BARS[i];
+		phase = __atomic_load_n(&slot->phase, __ATOMIC_RELAXED);
+
+		if (!file_bytes && phase == PHASE_IDLE)
+		{
+			snprintf(bar->label, sizeof(bar->label), "[%2d] %-24s %-24.24s", i + 1, "[         idle         ]", "");
+			__sample_bar(bar, done, lines, 0, 0, now);
+			bar->eta = -1;
+			continue;
+		}
+
+		snprintf(bar->label, sizeof(bar->label), "[%2d] %-24s %-24.24s", i + 1,
+			phase_labels[phase], JOBS[__atomic_load_n(&slot->job, __ATOMIC_RELAXED)].name);
+		__sample_bar(bar, done, lines, frac * 100, (size_t)((1 - frac) * (double)file_bytes), now);
+	}
+
+	if (FILES_FAILED)
+		snprintf(OVERALL_BAR.label, sizeof(OVERALL_BAR.label), "[ Overall: %d/%d files, %d failed ]",
+			FILES_DONE, NR_JOBS, FILES_FAILED);
+	else
+		snprintf(OVERALL_BAR.label, sizeof(OVERALL_BAR.label), "[ Overall: %d/%d files ]",
+			FILES_DONE, NR_JOBS);
+
+	__sample_bar(&OVERALL_BAR, all_done, all_lines,
+		global_data.total_bytes ? ((double)all_done / (double)global_data.total_bytes) * 100 : 100,
+		global_data.total_bytes > all_done ? global_data.total_bytes - all_done : 0, now);
+}
+
+/**
+ * Print where the time went once everything is finished
+ * (--stats). Times are summed over all of the workers.
+ */
+static void
+print_stats(void)
+{
+	double	secs;
+	int		i;
+	int		k;
+
+	fprintf(stderr, "\n%-10s %6s %10s %10s %12s", "phase", "files", "seconds", "MB/s", "lines");
+	for (k = 0; k < NR_PERF_COUNTERS; ++k)
+	{
+		if (PERF_OPENED[k])
+			fprintf(stderr, " %14s", perf_events[k].name);
+	}
+
+	if (PERF_OPENED[0] && PERF_OPENED[1])
+		fprintf(stderr, " %6s", "IPC");
+	fputc(0x0a, stderr);
+
+	for (i = PHASE_NORMALISE; i < NR_PHASE_TYPES; ++i)
+	{
+		if (!PHASE_COUNT[i])
+			continue;
+
+		secs = (double)PHASE_TOTAL_NS[i] / 1e9;
+		fprintf(stderr, "%-10s %6d %10.4f %10.1f %12zu", phase_names[i], PHASE_COUNT[i], secs,
+			secs > 0 ? ((double)PHASE_TOTAL_BYTES[i] / secs) / (1024 * 1024) : 0,
+			PHASE_TOTAL_LINES[i]);
+
+		for (k = 0; k < NR_PERF_COUNTERS; ++k)
+		{
+			if (PERF_OPENED[k])
+				fprintf(stderr, " %14lu", (unsigned long)PERF_TOTALS[i][k]);
+		}
+
+		if (PERF_OPENED[0] && PERF_OPENED[1])
+			fprintf(stderr, " %6.2f", PERF_TOTALS[i][0] ? (double)PERF_TOTALS[i][1] / (double)PERF_TOTALS[i][0] : 0);
+		fputc(0x0a, stderr);
+	}
+
+	fprintf(stderr, "\nkernels: %s (hand-written), %s (multiversioned)\n", SIMD_LEVEL, clone_level());
+
+#ifdef ACCOUNTING
+	fprintf(stderr, "\n%-10s", "phase");
+	for (k = 0; k < NR_ACCT; ++k)
+		fprintf(stderr, " %12s", acct_names[k]);
+	fputc(0x0a, stderr);
+
+	for (i = PHASE_IDLE; i < NR_PHASE_TYPES; ++i)
+	{
+		if (i != PHASE_IDLE && !PHASE_COUNT[i])
+			continue;
+
+		fprintf(stderr, "%-10s", i == PHASE_IDLE ? "map/unmap" : phase_names[i]);
+		for (k = 0; k < NR_ACCT; ++k)
+			fprintf(stderr, " %12lu", (unsigned long)ACCT_TOTALS[i][k]);
+		fputc(0x0a, stderr);
+	}
+#endif
+}
+
+/**
+ * Displays the progress of the formatting operations.
+ *
+ * Rather than spinning on the counters, we wake up at a fixed
+ * low rate (or when everything is finished), consume the events
+ * the workers have published and work out the throughput since
+ * the last refresh. The time remaining is based on an
+ * exponentially weighted moving average of the throughput so
+ * that it does not jump about with every refresh.
+ */
+static void *
+show_progress(void *arg)
+{
+	struct timespec	deadline;
+	uint64_t	now;
+	uint64_t	cost;
+	long			refresh_ns = PROGRESS_REFRESH_NS;
+	int				finished;
+
+	OVERALL_BAR.start_ns = START_NS;
+	OVERALL_BAR.eta = -1;
+
+	if (EVENT_FP)
+	{
+		fprintf(EVENT_FP, "{\"event\":\"start\",\"t\":%.6f,\"files\":%d,\"workers\":%d,\"total_bytes\":%zu}\n",
+			__event_secs(__now_ns()), NR_JOBS, NR_WORKERS, global_data.total_bytes);
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&PROGRESS_MTX);
+		finished = global_data.finished;
+		pthread_mutex_unlock(&PROGRESS_MTX);
+
+		now = __now_ns();
+
+		__drain_events();
+		__sample_progress(now);
+
+		if (finished)
+		{
+			int		i;
+
+			__finish_bar(&OVERALL_BAR, OVERALL_BAR.prev_bytes, OVERALL_BAR.prev_lines, now, FILES_FAILED);
+			for (i = 0; i < NR_WORKERS; ++i)
+				WORKER_BARS[i].eta = 0;
+		}
+
+		if (EVENT_FP)
+		{
+			__emit_progress(now);
+			if (finished)
+				__emit_summary(now);
+			fflush(EVENT_FP);
+		}
+
+		if (WINCH_PENDING)
+		{
+			WINCH_PENDING = 0;
+			render_resize();
+		}
+
+		__draw_ui();
+		render_flush();
+
+		if (finished)
+			break;
+
+		/*
+		 * Never spend more than a few percent of our
+		 * time drawing, however slow the terminal is.
+		 */
+		cost = (__now_ns() - now);
+		refresh_ns = (long)cost * 20;
+		if (refresh_ns < PROGRESS_REFRESH_NS)
+			refresh_ns = PROGRESS_REFRESH_NS;
+
+		/*
+		 * pthread_cond_timedwait() wants an absolute
+		 * time against CLOCK_REALTIME.
+		 */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (refresh_ns % 1000000000L);
+		deadline.tv_sec += (refresh_ns / 1000000000L) + (deadline.tv_nsec / 1000000000L);
+		deadline.tv_nsec %= 1000000000L;
+
+		pthread_mutex_lock(&PROGRESS_MTX);
+		if (!global_data.finished)
+			pthread_cond_timedwait(&PROGRESS_COND, &PROGRESS_MTX, &deadline);
+		pthread_mutex_unlock(&PROGRESS_MTX);
+	}
+
+	pthread_exit((void *)0);
+}
+
+/**
+ * Tell the progress thread that all of the work is over
+ * (successfully or not) and wait for it to draw the final
+ * state of the bars.
+ */
+static void
+end_progress(void)
+{
+	pthread_mutex_lock(&PROGRESS_MTX);
+	global_data.finished = 1;
+	pthread_cond_signal(&PROGRESS_COND);
+	pthread_mutex_unlock(&PROGRESS_MTX);
+
+	pthread_join(TID_SP, NULL);
+}
+
+#ifdef ACCOUNTING
+# define mmap(a, l, p, f, d, o) __acct_mmap(a, l, p, f, d, o)
+# define mremap(o, os, ns, f) __acct_mremap(o, os, ns, f)
+# define ftruncate(d, l) __acct_ftruncate(d, l)
+# define posix_fallocate(d, o, l) __acct_posix_fallocate(d, o, l)
+# define memmove(t, f, n) __acct_memmove(t, f, n)
+#endif
+
+/*
+ * Allocate BY bytes of disc space at the end of the file and
+ * update the vma accordingly. The kernel will grow the vma in
+ * place if the address space after it is free, and will only
+ * move it if it has to. We used to insist on the same start
+ * address with MAP_FIXED, but that silently replaces whatever
+ * happens to be mapped after the vma -- such as the file that
+ * another worker is formatting.
+ */
+static void *
+__extend_file_and_map(mapped_file_t *f, off_t by)
+{
+	assert(f);
+
+	size_t	map_size;
+	void		*startp;
+	int			err;
+
+	if (by <= 0)
+		return f->startp;
+
+	if ((err = posix_fallocate(f->fd, (off_t)((char *)f->endp - (char *)f->startp), by)) != 0)
+	{
+		fprintf(stderr, "__extend_file_and_map: posix_fallocate error (%s)\n", strerror(err));
+		return NULL;
+	}
+
+	f->current_file_size += (size_t)by;
+
+	/*
+	 * The mapping may be bigger than the file, if it was cut
+	 * down to nothing (see __truncate_file()).
+	 */
+	map_size = f->current_file_size;
+
+	if ((startp = mremap(f->startp, f->map_size, map_size, MREMAP_MAYMOVE)) == MAP_FAILED)
+	{
+		fprintf(stderr, "__extend_file_and_map: mremap error (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	f->startp = startp;
+
+	f->map_size = map_size;
+	f->endp = ((char *)f->startp + map_size);
+
+	probe3(extend, (long)by, f->current_file_size, startp);
+
+	return f->startp;
+}
+
+/*
+ * Cut the file and vma down to their first SIZE bytes, once
+ * a pass has compacted everything it keeps to the front.
+ */
+static int
+__truncate_file(mapped_file_t *f, size_t size)
+{
+	assert(f);
+
+	if (size >= f->current_file_size)
+		return 0;
+
+	/*
+	 * Shrinking a mapping never moves it. A mapping can't be
+	 * made empty, so with nothing left it is kept as it is and
+	 * unmapped whole at the end.
+	 */
+	if (size)
+	{
+		if (mremap(f->startp, f->map_size, size, 0) == MAP_FAILED)
+		{
+			fprintf(stderr, "__truncate_file: mremap error (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		f->map_size = size;
+	}
+
+	f->endp = ((char *)f->startp + size);
+
+	/*
+	 * With --reserve the file keeps its blocks until we are
+	 * done with it, so that a later phase can't find them gone.
+	 */
+	if (!f->reserved && ftruncate(f->fd, (off_t)size) < 0)
+	{
+		fprintf(stderr, "__truncate_file: ftruncate error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	probe2(truncate, f->current_file_size, size);
+	f->current_file_size = size;
+
+	return 0;
+}
+
+/*
+ * Output sink for passes that rewrite the file front to back in
+ * a single pass. The pass reads its input at logical offsets and
+ * tells the sink to copy, skip or insert bytes, and the sink
+ * writes the output over the input it has already consumed. Input
+ * at offset N lives at STARTP+N+GAP; when an insertion would catch
+ * up with the input, the unread tail is moved up by at least half
+ * its length and at least as far again as it has moved already,
+ * so that a pass costs O(log N) remaps and moves each byte O(1)
+ * times however many bytes it inserts (N being the larger of the
+ * input and the output).
+ *
+ * A sink can instead send its output to a file descriptor, leaving
+ * the input as it is, so that several passes can read the same
+ * input at once (see sink_init_fd()), or keep a journal so that a
+ * pass that is killed can be carried on with (see journal_t).
+ */
+struct journal_t;
+
+typedef struct sink_t
+{
+	mapped_file_t	*file;
+	size_t				in_size;	/* bytes of input */
+	size_t				rd;				/* input consumed */
+	size_t				wr;				/* output written */
+	size_t				gap;			/* distance the unread input has moved up */
+	int						fd;				/* where the output goes, or -1 for in place */
+	int						error;		/* a write to FD failed */
+	char					*buf;			/* output not yet written to FD */
+	size_t				buf_len;
+	size_t				hint;			/* what the pass is known to add (--reserve) */
+	struct journal_t	*jr;
+} sink_t;
+
+#define SINK_MIN_GAP	(64 * 1024)
+#define SINK_BUF_SIZE	(64 * 1024)
+
+static __thread size_t	INSERTED;		/* bytes inserted and deleted, for --dry-run */
+static __thread size_t	DELETED;
+
+#define sink_input(s) ((const char *)(s)->file->startp + (s)->gap)
+
+static int
+__write_all(int fd, char *buf, size_t size)
+{
+	ssize_t	n;
+
+	while (size)
+	{
+		if ((n = write(fd, buf, size)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "__write_all: write error (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		buf += n;
+		size -= (size_t)n;
+	}
+
+	return 0;
+}
+
+static void
+sink_init(sink_t *s, mapped_file_t *f)
+{
+	clear_struct(s);
+	s->file = f;
+	s->in_size = f->current_file_size;
+	s->fd = -1;
+	s->hint = f->grow_hint;
+}
+
+/*
+ * Read from F but write the output to FD, through BUF
+ * (SINK_BUF_SIZE bytes).
+ */
+static void
+sink_init_fd(sink_t *s, mapped_file_t *f, int fd, char *buf)
+{
+	sink_init(s, f);
+	s->fd = fd;
+	s->buf = buf;
+}
+
+static void
+__sink_flush(sink_t *s)
+{
+	if (s->buf_len && !s->error && __write_all(s->fd, s->buf, s->buf_len) < 0)
+		s->error = 1;
+
+	s->buf_len = 0;
+}
+
+static void
+__sink_emit(sink_t *s, const char *data, size_t len)
+{
+	if ((s->buf_len + len) > SINK_BUF_SIZE)
+		__sink_flush(s);
+
+	if (len >= SINK_BUF_SIZE)
+	{
+		if (!s->error && __write_all(s->fd, (char *)data, len) < 0)
+			s->error = 1;
+	}
+	else
+	{
+		memcpy(s->buf + s->buf_len, data, len);
+		s->buf_len += len;
+	}
+
+	s->wr += len;
+}
+
+static int
+__sink_grow(sink_t *s, size_t need)
+{
+	size_t	tail = (s->in_size - s->rd);
+	size_t	by = (tail / 2);
+	char		*from;
+
+	if (by < s->gap)
+		by = s->gap;
+	if (by < need)
+		by = need;
+	if (by < SINK_MIN_GAP)
+		by = SINK_MIN_GAP;
+
+	/*
+	 * Knowing what the pass adds, the gap can be made
+	 * that big at once, and the file no bigger.
+	 */
+	if (s->hint)
+	{
+		by = (s->hint > need ? s->hint : need);
+		s->hint = 0;
+	}
+
+	if (!__extend_file_and_map(s->file, (off_t)by))
+		return -1;
+
+	from = ((char *)s->file->startp + s->rd + s->gap);
+	memmove(from + by, from, tail);
+	s->gap += by;
+
+	return 0;
+}
+
+/*
+ * Checkpoints for a pass that rewrites a file in place through a
+ * sink (--checkpoint). Now and then, at the start of a line, the
+ * pass syncs the file and records in a journal beside it where it
+ * has got to in the input and the output, where the unread input
+ * is and how many lines it has done. Output may not go past where
+ * the input of the last checkpoint was, so the file always holds
+ * all that is needed to carry on from it (--resume); when a write
+ * would, the sink takes a checkpoint where it is now, growing the
+ * gap first if it has to. The tail is moved up to grow the gap in
+ * pieces no longer than the distance it moves, from the top down,
+ * with a checkpoint after each, so that none of it is overwritten
+ * before it has been copied and a move that was cut short can be
+ * finished.
+ */
+#define JOURNAL_SUFFIX			".ftext-journal"
+#define JOURNAL_VERSION			1
+#define CHECKPOINT_DEFAULT	(1024UL * 1024 * 1024)
+
+typedef struct journal_t
+{
+	char		path[PATH_MAX];
+	char		sig[256];		/* the options the run was started with */
+	int			phase;
+	int			done;				/* the phase has finished */
+	size_t	width;
+	size_t	every;			/* bytes of input between checkpoints */
+	size_t	next;				/* input offset of the next one */
+	size_t	limit;			/* output may not go past this */
+	size_t	rd;					/* the start of the current line, */
+	size_t	wr;					/* the output before it */
+	size_t	lines;			/* and the lines before it */
+	size_t	in_size;		/* the sink as it was at the checkpoint */
+	size_t	gap;				/* loaded from the journal */
+	size_t	grow;				/* how far the tail is being moved up */
+	size_t	moved;			/* and how much of it has been */
+	size_t	synced;			/* output before this is on the disc */
+} journal_t;
+
+static size_t	CHECKPOINT_EVERY = CHECKPOINT_DEFAULT;
+
+/*
+ * Get the bytes of the file in [FROM,TO) to the disc.
+ */
+static int
+__journal_sync(sink_t *s, size_t from, size_t to)
+{
+	size_t	page = (size_t)sysconf(_SC_PAGESIZE);
+
+	from &= ~(page - 1);
+
+	if (to > s->file->map_size)
+		to = s->file->map_size;
+
+	if (to <= from)
+		return 0;
+
+	if (msync((char *)s->file->startp + from, to - from, MS_SYNC) < 0)
+	{
+		fprintf(stderr, "__journal_sync: msync error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Only the output written since the last checkpoint has to be synced
+ * before the journal is: the output is written in order, and the
+ * tail is synced as it is moved (see __journal_move()).
+ */
+static int
+__journal_save(sink_t *s)
+{
+	journal_t	*jr = s->jr;
+	FILE			*fp;
+	char			tmp[PATH_MAX + 8];
+
+	if (__journal_sync(s, jr->synced, s->wr) < 0)
+		return -1;
+
+	jr->synced = s->wr;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", jr->path);
+
+	if (!(fp = fopen(tmp, "w")))
+	{
+		fprintf(stderr, "__journal_save: fopen error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "%sphase=%d done=%d width=%zu in=%zu rd=%zu wr=%zu gap=%zu lines=%zu grow=%zu moved=%zu\n",
+		jr->sig, jr->phase, jr->done, jr->width, s->in_size, jr->rd, jr->wr, s->gap,
+		jr->lines, jr->grow, jr->moved);
+
+	/*
+	 * The journal must not get to the disc before the
+	 * file does, nor be left half written.
+	 */
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0 || fclose(fp) != 0 || rename(tmp, jr->path) < 0)
+	{
+		fprintf(stderr, "__journal_save: failed to write %s (%s)\n", jr->path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	if (!jr->grow)
+	{
+		jr->limit = (jr->rd + s->gap);
+		jr->next = (jr->rd + jr->every);
+	}
+
+	probe2(checkpoint, jr->rd, jr->wr);
+
+	return 0;
+}
+
+/*
+ * Carry on moving the input after the checkpoint up by JR->GROW,
+ * from JR->MOVED bytes down from the top of it.
+ */
+static int
+__journal_move(sink_t *s)
+{
+	journal_t	*jr = s->jr;
+	char			*from = ((char *)s->file->startp + jr->rd + s->gap);
+	size_t		tail = (s->in_size - jr->rd);
+	size_t		to;
+	size_t		n;
+
+	while (jr->moved < tail)
+	{
+		n = (tail - jr->moved);
+		if (n > jr->grow)
+			n = jr->grow;
+
+		jr->moved += n;
+		to = (jr->rd + s->gap + (tail - jr->moved) + jr->grow);
+		memmove((char *)s->file->startp + to, from + (tail - jr->moved), n);
+
+		if (__journal_sync(s, to, to + n) < 0 || __journal_save(s) < 0)
+			return -1;
+	}
+
+	s->gap += jr->grow;
+	jr->grow = jr->moved = 0;
+
+	return 0;
+}
+
+/*
+ * Make room to write LEN more bytes without overwriting the input
+ * of the last checkpoint. The gap is doubled (or made the length
+ * of a checkpoint) once less than half of it would be left, rather
+ * than grown by half the tail as usual, so that a pass that gets no
+ * longer, such as the normaliser, needs no more disc than that.
+ */
+static int
+__journal_room(sink_t *s, size_t len)
+{
+	journal_t	*jr = s->jr;
+	size_t		tail = (s->in_size - jr->rd);
+	size_t		need = 0;
+	size_t		by;
+
+	if (s->error)
+		return -1;
+
+	if ((s->wr + len) <= jr->limit)
+		return 0;
+
+	if ((s->wr + len) > (jr->rd + s->gap))
+		need = ((s->wr + len) - (jr->rd + s->gap));
+
+	by = (s->gap > jr->every ? s->gap : jr->every);
+	if (by > tail)
+		by = tail;
+	if (by < need)
+		by = need;
+
+	if (by && (s->wr + len) > (jr->rd + s->gap - (s->gap / 2)))
+	{
+		if (!__extend_file_and_map(s->file, (off_t)by))
+			goto fail;
+
+		jr->grow = by;
+		jr->moved = 0;
+
+		if (__journal_move(s) < 0)
+			goto fail;
+	}
+
+	if (__journal_save(s) < 0)
+		goto fail;
+
+	return 0;
+
+	fail:
+	s->error = 1;
+	return -1;
+}
+
+static void
+__sink_mark(sink_t *s, size_t lines)
+{
+	journal_t	*jr = s->jr;
+
+	jr->rd = s->rd;
+	jr->wr = s->wr;
+	jr->lines = lines;
+
+	if (s->rd >= jr->next && !s->error && __journal_save(s) < 0)
+		s->error = 1;
+}
+
+/*
+ * The pass is at the start of a line, with LINES before it:
+ * somewhere it can be carried on from.
+ */
+static inline void
+sink_mark(sink_t *s, size_t lines)
+{
+	if (unlikely(s->jr != NULL))
+		__sink_mark(s, lines);
+}
+
+#define sink_lines(s) ((s)->jr ? (s)->jr->lines : 0)
+
+/*
+ * Keep a journal of the sink in JR, carrying on from where it
+ * left off if it was loaded from one part way through the pass.
+ */
+static int
+sink_attach(sink_t *s, journal_t *jr)
+{
+	s->jr = jr;
+
+	/*
+	 * What the last phase wrote has to get to the disc the once.
+	 */
+	if (__journal_sync(s, 0, s->file->map_size) < 0)
+		return -1;
+
+	if (jr->in_size)
+	{
+		s->in_size = jr->in_size;
+		s->rd = jr->rd;
+		s->wr = jr->wr;
+		s->gap = jr->gap;
+		jr->in_size = jr->gap = 0;
+		jr->synced = s->wr;
+
+		if (jr->grow && __journal_move(s) < 0)
+			return -1;
+	}
+	else
+	{
+		jr->rd = jr->wr = jr->lines = 0;
+		jr->grow = jr->moved = jr->synced = 0;
+	}
+
+	return __journal_save(s);
+}
+
+/*
+ * Pass the next LEN bytes of input through to the output.
+ */
+static inline void
+sink_copy(sink_t *s, size_t len)
+{
+	char	*startp = (char *)s->file->startp;
+
+	if (unlikely(s->fd >= 0))
+	{
+		__sink_emit(s, startp + s->rd, len);
+		s->rd += len;
+		return;
+	}
+
+	if (s->wr != (s->rd + s->gap))
+	{
+		if (unlikely(s->jr != NULL) && __journal_room(s, len) < 0)
+			return;
+
+		startp = (char *)s->file->startp;
+		memmove(startp + s->wr, startp + s->rd + s->gap, len);
+	}
+
+	s->wr += len;
+	s->rd += len;
+}
+
+static inline void
+sink_skip(sink_t *s, size_t len)
+{
+	s->rd += len;
+	DELETED += len;
+}
+
+static inline int
+sink_put(sink_t *s, const char *buf, size_t len)
+{
+	INSERTED += len;
+
+	if (unlikely(s->fd >= 0))
+	{
+		__sink_emit(s, buf, len);
+		return 0;
+	}
+
+	if (unlikely(s->jr != NULL))
+	{
+		if (__journal_room(s, len) < 0)
+			return -1;
+	}
+	else
+	if ((s->wr + len) > (s->rd + s->gap)
+	&& __sink_grow(s, (s->wr + len) - (s->rd + s->gap)) < 0)
+		return -1;
+
+	memcpy((char *)s->file->startp + s->wr, buf, len);
+	s->wr += len;
+
+	return 0;
+}
+
+/*
+ * Write LEN copies of C to the output.
+ */
+static inline int
+sink_fill(sink_t *s, int c, size_t len)
+{
+	char		pad[256];
+	size_t	n;
+
+	INSERTED += len;
+
+	if (unlikely(s->fd >= 0))
+	{
+		memset(pad, c, sizeof(pad));
+
+		for (; len; len -= n)
+		{
+			n = (len < sizeof(pad) ? len : sizeof(pad));
+			__sink_emit(s, pad, n);
+		}
+
+		return 0;
+	}
+
+	if (unlikely(s->jr != NULL))
+	{
+		if (__journal_room(s, len) < 0)
+			return -1;
+	}
+	else
+	if ((s->wr + len) > (s->rd + s->gap)
+	&& __sink_grow(s, (s->wr + len) - (s->rd + s->gap)) < 0)
+		return -1;
+
+	memset((char *)s->file->startp + s->wr, c, len);
+	s->wr += len;
+
+	return 0;
+}
+
+/*
+ * All the input has been consumed: drop what is left of the gap.
+ * With a journal, the end of the pass is recorded first, so that
+ * a run killed in between knows only the cut is left to do.
+ */
+static int
+sink_finish(sink_t *s)
+{
+	if (s->fd >= 0)
+	{
+		__sink_flush(s);
+		return (s->error ? -1 : 0);
+	}
+
+	if (s->jr)
+	{
+		if (s->error)
+			return -1;
+
+		s->jr->rd = s->in_size;
+		s->jr->wr = s->wr;
+		s->jr->done = 1;
+
+		if (__journal_save(s) < 0)
+			return -1;
+	}
+
+	return __truncate_file(s->file, s->wr);
+}
+
+/*
+ * Bitmap of the 64 bytes at P that are equal to C. Written so that
+ * the compare vectorises at the width of whichever multiversioned
+ * function it is inlined into.
+ */
+static inline uint64_t
+__eq_mask64(const char *p, char c)
+{
+	uint8_t		b[64];
+	uint64_t	m = 0;
+	uint64_t	x;
+	int				j;
+
+	for (j = 0; j < 64; ++j)
+		b[j] = (p[j] == c);
+
+	for (j = 0; j < 8; ++j)
+	{
+		memcpy(&x, b + (j * 8), 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		x = __builtin_bswap64(x);
+#endif
+		m |= ((x * 0x0102040810204080ULL) >> 56) << (j * 8);
+	}
+
+	return m;
+}
+
+/*
+ * Number of lines and length of the longest line of a piece of
+ * the file. A line that runs off either end of the piece is still
+ * open, and only its length within the piece is known (PREFIX and
+ * SUFFIX). Summaries of neighbouring pieces join into the summary
+ * of both, so that a file can be cut anywhere and its pieces
+ * scanned in parallel.
+ */
+typedef struct line_stats_t
+{
+	size_t	lines;
+	size_t	longest;		/* longest line with both ends in the piece */
+	size_t	prefix;			/* bytes before the first new line */
+	size_t	suffix;			/* bytes after the last new line */
+	size_t	folds;			/* new lines --fold adds to the lines with both ends in the piece */
+} line_stats_t;
+
+/*
+ * Don't bother splitting a file into pieces smaller than this.
+ */
+#define LINE_STATS_MIN_PIECE	(1024 * 1024)
+#define LINE_STATS_MAX_PIECES	MAX_WORKERS
+
+typedef struct line_stats_job_t
+{
+	pthread_t			tid;
+	int						started;
+	const char		*p;
+	size_t				len;
+	line_stats_t	st;
+} line_stats_job_t;
+
+/*
+ * New lines that folding to WIDTH adds to LEN bytes of a line
+ * that starts in COLUMN: one before each byte whose column is a
+ * multiple of WIDTH, bar the first column of all.
+ */
+static inline size_t
+__fold_count(size_t column, size_t len, size_t width)
+{
+	if (!len)
+		return 0;
+
+	return (((column + len - 1) / width) - (column ? ((column - 1) / width) : 0));
+}
+
+/*
+ * With FOLD set, also count how many new lines folding to FOLD
+ * bytes would add.
+ */
+multiversion
+static void
+__line_stats_scan(line_stats_t *st, const char *p, size_t len, size_t fold)
+{
+	uint64_t	m;
+	size_t		line = 0;
+	size_t		i;
+	size_t		nl;
+
+	clear_struct(st);
+
+	for (i = 0; i < len; i += 64)
+	{
+		if ((i + 64) <= len)
+		{
+			m = __eq_mask64(p + i, 0x0a);
+		}
+		else
+		{
+			for (m = 0, nl = i; nl < len; ++nl)
+				m |= ((uint64_t)(p[nl] == 0x0a) << (nl - i));
+		}
+
+		for (; m; m &= (m - 1))
+		{
+			nl = (i + __builtin_ctzll(m));
+
+			if (!st->lines)
+				st->prefix = nl;
+			else
+			{
+				if ((nl - line) > st->longest)
+					st->longest = (nl - line);
+				if (fold)
+					st->folds += __fold_count(0, nl - line, fold);
+			}
+
+			++st->lines;
+			line = (nl + 1);
+		}
+	}
+
+	if (!st->lines)
+		st->prefix = len;
+
+	st->suffix = (len - line);
+}
+
+/*
+ * A is the piece just before B.
+ */
+static void
+__line_stats_join(line_stats_t *a, const line_stats_t *b)
+{
+	if (b->longest > a->longest)
+		a->longest = b->longest;
+
+	if (a->lines && b->lines && (a->suffix + b->prefix) > a->longest)
+		a->longest = (a->suffix + b->prefix);
+
+	if (!a->lines)
+		a->prefix += b->prefix;
+
+	if (b->lines)
+		a->suffix = b->suffix;
+	else
+		a->suffix += b->suffix;
+
+	a->lines += b->lines;
+}
+
+/*
+ * How many pieces to cut SIZE bytes into, to share a scan
+ * out over the CPUs that the workers aren't already using.
+ */
+static int
+__nr_pieces(size_t size)
+{
+	int		nr_pieces = (NR_CPUS / NR_WORKERS);
+
+	if ((size_t)nr_pieces > (size / LINE_STATS_MIN_PIECE))
+		nr_pieces = (int)(size / LINE_STATS_MIN_PIECE);
+	if (nr_pieces > LINE_STATS_MAX_PIECES)
+		nr_pieces = LINE_STATS_MAX_PIECES;
+	if (nr_pieces < 1)
+		nr_pieces = 1;
+
+	return nr_pieces;
+}
+
+static void *
+__line_stats_worker(void *arg)
+{
+	line_stats_job_t	*job = (line_stats_job_t *)arg;
+
+	__line_stats_scan(&job->st, job->p, job->len, 0);
+	return NULL;
+}
+
+/*
+ * Count the lines of the file and find the longest of them,
+ * sharing the scan out over the CPUs that the workers aren't
+ * already using. Only lines ending with 0x0a are counted, and
+ * the text is expected to be normalised already, so a line is
+ * as long as its bytes.
+ */
+static void
+get_line_stats(mapped_file_t *f, size_t *nr_lines, size_t *longest)
+{
+	assert(f);
+
+	line_stats_job_t	jobs[LINE_STATS_MAX_PIECES];
+	const char				*startp = (const char *)f->startp;
+	size_t						size = f->current_file_size;
+	int								nr_pieces = __nr_pieces(size);
+	size_t						piece = (size / nr_pieces);
+	int								i;
+
+	for (i = 0; i < nr_pieces; ++i)
+	{
+		jobs[i].p = (startp + (i * piece));
+		jobs[i].len = (i == (nr_pieces - 1) ? size - (i * piece) : piece);
+
+		/*
+		 * If we can't have another thread, just do it ourselves.
+		 */
+		jobs[i].started = (i && pthread_create(&jobs[i].tid, NULL, __line_stats_worker, (void *)&jobs[i]) == 0);
+
+		if (i && !jobs[i].started)
+			__line_stats_scan(&jobs[i].st, jobs[i].p, jobs[i].len, 0);
+	}
+
+	__line_stats_scan(&jobs[0].st, jobs[0].p, jobs[0].len, 0);
+
+	for (i = 1; i < nr_pieces; ++i)
+	{
+		if (jobs[i].started)
+			pthread_join(jobs[i].tid, NULL);
+
+		__line_stats_join(&jobs[0].st, &jobs[i].st);
+	}
+
+	*nr_lines = jobs[0].st.lines;
+	*longest = jobs[0].st.longest;
+
+	/*
+	 * The first line starts at the start of the file.
+	 */
+	if (jobs[0].st.lines && jobs[0].st.prefix > *longest)
+		*longest = jobs[0].st.prefix;
+}
+
+/*
+ * Some formatting options require knowing the longest line
+ * in the file in order to format the other lines accordingly.
+ * E.g., justifying the text means adding enough spaces to
+ * all lines shorter than the longest line; centre-aligning
+ * means knowing the character offset of the centre of longest
+ * line.
+ */
+static int
+__get_length_longest_line(mapped_file_t *f)
+{
+	size_t	nr_lines;
+	size_t	longest;
+
+	get_line_stats(f, &nr_lines, &longest);
+	return (longest > INT_MAX ? INT_MAX : (int)longest);
+}
+
+/*
+ * Stream compaction kernels for the normaliser. Each one reads
+ * LEN bytes from SRC and writes what it keeps to DST, returning
+ * the number of bytes written. DST may be the same as SRC (or
+ * anywhere before it), so a pass can compact the file in place
+ * and then cut it down once with __truncate_file() instead of
+ * collapsing it once for every byte it removes. A kernel carries
+ * what it needs to know about the bytes before SRC in a small
+ * state struct, so that a file can be fed through it in blocks.
+ *
+ * The vector versions only ever store into the block that they
+ * have just loaded, which is what makes working in place safe.
+ */
+typedef struct squeeze_t
+{
+	int		space;		/* last byte seen was 0x20 */
+} squeeze_t;
+
+typedef size_t (*squeeze_fn_t)(squeeze_t *, char *, const char *, size_t);
+typedef size_t (*strip_fn_t)(char *, const char *, size_t);
+
+/**
+ * Drop every 0x0d.
+ */
+static size_t
+__strip_cr_scalar(char *dst, const char *src, size_t len)
+{
+	const char	*endp = (src + len);
+	char	*d = dst;
+
+	while (src < endp)
+	{
+		*d = *src++;
+		d += (*d != 0x0d);
+	}
+
+	return (d - dst);
+}
+
+/**
+ * Squeeze each run of spaces down to one space.
+ */
+static size_t
+__squeeze_spaces_scalar(squeeze_t *st, char *dst, const char *src, size_t len)
+{
+	const char	*endp = (src + len);
+	char	*d = dst;
+	char	c;
+	int		space = st->space;
+
+	while (src < endp)
+	{
+		c = *src++;
+
+		if (c == 0x20)
+		{
+			if (space)
+				continue;
+
+			space = 1;
+		}
+		else
+		{
+			space = 0;
+		}
+
+		*d++ = c;
+	}
+
+	st->space = space;
+	return (d - dst);
+}
+
+/*
+ * State for trimming the whitespace from both ends of each line.
+ * Whitespace after the last other byte on a line can only be
+ * dropped once we see whether a new line or something else comes
+ * next, so it is held back in a small window until then. A run
+ * that outgrows the window (e.g. a line of nothing but a thousand
+ * spaces and then a word) spills over to the heap.
+ */
+#define TRIM_WINDOW	64
+
+typedef struct trim_t
+{
+	int		line_start;		/* still in the whitespace at the start of a line */
+	int		failed;				/* could not hold back a run of whitespace */
+	size_t	nr_held;
+	size_t	max_held;
+	char	*held;				/* WINDOW, or the heap */
+	char	window[TRIM_WINDOW];
+} trim_t;
+
+typedef size_t (*trim_fn_t)(trim_t *, char *, const char *, size_t);
+
+static void
+trim_init(trim_t *st)
+{
+	clear_struct(st);
+	st->line_start = 1;
+	st->held = st->window;
+	st->max_held = TRIM_WINDOW;
+}
+
+/**
+ * End of input: anything still held is trailing whitespace on
+ * the last line and is dropped. Returns -1 if anything went
+ * wrong along the way.
+ */
+static int
+trim_finish(trim_t *st)
+{
+	if (st->held != st->window)
+		free(st->held);
+
+	st->held = st->window;
+	st->max_held = TRIM_WINDOW;
+	st->nr_held = 0;
+
+	return (st->failed ? -1 : 0);
+}
+
+static void
+__trim_hold(trim_t *st, const char *src, size_t len)
+{
+	size_t	max = st->max_held;
+	char	*held;
+
+	if ((st->nr_held + len) > max)
+	{
+		while ((st->nr_held + len) > max)
+			max <<= 1;
+
+		if (st->held == st->window)
+		{
+			if ((held = malloc(max)))
+				memcpy(held, st->window, st->nr_held);
+		}
+		else
+		{
+			held = realloc(st->held, max);
+		}
+
+		if (!held)
+		{
+			st->failed = 1;
+			return;
+		}
+
+		st->held = held;
+		st->max_held = max;
+	}
+
+	memcpy(st->held + st->nr_held, src, len);
+	st->nr_held += len;
+}
+
+#define is_blank(c) ((c) == 0x20 || (c) == 0x09)
+
+/**
+ * Drop the whitespace (0x20 / 0x09) at the start and
+ * end of each line.
+ */
+static size_t
+__trim_scalar(trim_t *st, char *dst, const char *src, size_t len)
+{
+	const char	*endp = (src + len);
+	const char	*run;
+	char	*d = dst;
+	char	c;
+
+	while (src < endp)
+	{
+		c = *src;
+
+		if (is_blank(c))
+		{
+			run = src;
+			while (src < endp && is_blank(*src))
+				++src;
+
+			if (st->line_start || (src < endp && *src == 0x0a))
+				continue;
+
+			/*
+			 * Only hold on to it if we can't yet
+			 * see what comes after it.
+			 */
+			if (src == endp)
+			{
+				__trim_hold(st, run, (size_t)(src - run));
+				continue;
+			}
+
+			if (st->nr_held)
+			{
+				memcpy(d, st->held, st->nr_held);
+				d += st->nr_held;
+				st->nr_held = 0;
+			}
+
+			memmove(d, run, (size_t)(src - run));
+			d += (src - run);
+			continue;
+		}
+
+		if (c == 0x0a)
+		{
+			st->nr_held = 0;
+			st->line_start = 1;
+		}
+		else
+		{
+			if (st->nr_held)
+			{
+				memcpy(d, st->held, st->nr_held);
+				d += st->nr_held;
+				st->nr_held = 0;
+			}
+
+			st->line_start = 0;
+		}
+
+		*d++ = c;
+		++src;
+	}
+
+	return (d - dst);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * For each 8-bit mask, the indices of its set bits packed
+ * to the front: a pshufb control that compacts 8 bytes.
+ */
+static uint64_t	COMPACT_SHUF[256];
+
+static void
+__init_compact_shuf(void)
+{
+	uint64_t	shuf;
+	int		mask;
+	int		bit;
+	int		n;
+
+	for (mask = 0; mask < 256; ++mask)
+	{
+		shuf = 0x8080808080808080ULL;
+
+		for (bit = 0, n = 0; bit < 8; ++bit)
+		{
+			if (!(mask & (1 << bit)))
+				continue;
+
+			shuf &= ~(0xffULL << (n * 8));
+			shuf |= ((uint64_t)bit << (n * 8));
+			++n;
+		}
+
+		COMPACT_SHUF[mask] = shuf;
+	}
+}
+
+/*
+ * Keep the bytes of V set in the 16-bit mask KEEP, writing them to D.
+ */
+#define __compact16(v, keep, d)																		\
+do {																																\
+	unsigned	__lo = (keep) & 0xff;																	\
+	unsigned	__hi = ((keep) >> 8) & 0xff;													\
+	__m128i		__shuf = _mm_set_epi64x((long long)(COMPACT_SHUF[__hi] + 0x0808080808080808ULL),\
+		(long long)COMPACT_SHUF[__lo]);																	\
+	__m128i		__packed = _mm_shuffle_epi8((v), __shuf);								\
+																																		\
+	_mm_storel_epi64((__m128i *)(d), __packed);											\
+	(d) += __builtin_popcount(__lo);																\
+	_mm_storel_epi64((__m128i *)(d), _mm_unpackhi_epi64(__packed, __packed));\
+	(d) += __builtin_popcount(__hi);																\
+} while (0)
+
+__attribute__((__target__("ssse3,popcnt")))
+static size_t
+__squeeze_spaces_ssse3(squeeze_t *st, char *dst, const char *src, size_t len)
+{
+	const __m128i	spaces = _mm_set1_epi8(0x20);
+	__m128i		v;
+	uint32_t	s;
+	uint32_t	drop;
+	uint32_t	carry = (uint32_t)st->space;
+	char		*d = dst;
+	size_t	i;
+
+	for (i = 0; (i + 16) <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		s = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, spaces));
+
+		/*
+		 * A space is dropped if the byte before it is also one.
+		 */
+		drop = s & ((s << 1) | carry);
+		carry = (s >> 15);
+
+		if (likely(!drop))
+		{
+			_mm_storeu_si128((__m128i *)d, v);
+			d += 16;
+			continue;
+		}
+
+		__compact16(v, ~drop, d);
+	}
+
+	st->space = (int)carry;
+	return (d - dst) + __squeeze_spaces_scalar(st, d, src + i, len - i);
+}
+
+__attribute__((__target__("ssse3,popcnt")))
+static size_t
+__strip_cr_ssse3(char *dst, const char *src, size_t len)
+{
+	const __m128i	crs = _mm_set1_epi8(0x0d);
+	__m128i		v;
+	uint32_t	drop;
+	char		*d = dst;
+	size_t	i;
+
+	for (i = 0; (i + 16) <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		drop = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, crs));
+
+		if (likely(!drop))
+		{
+			_mm_storeu_si128((__m128i *)d, v);
+			d += 16;
+			continue;
+		}
+
+		__compact16(v, ~drop, d);
+	}
+
+	return (d - dst) + __strip_cr_scalar(d, src + i, len - i);
+}
+
+/*
+ * Spread each bit in G up (or down) through any run
+ * of set bits in P that it is part of.
+ */
+static inline uint64_t
+__flood_up(uint64_t g, uint64_t p)
+{
+	g |= p & (g << 1); p &= (p << 1);
+	g |= p & (g << 2); p &= (p << 2);
+	g |= p & (g << 4); p &= (p << 4);
+	g |= p & (g << 8); p &= (p << 8);
+	g |= p & (g << 16); p &= (p << 16);
+	g |= p & (g << 32);
+
+	return g;
+}
+
+static inline uint64_t
+__flood_down(uint64_t g, uint64_t p)
+{
+	g |= p & (g >> 1); p &= (p >> 1);
+	g |= p & (g >> 2); p &= (p >> 2);
+	g |= p & (g >> 4); p &= (p >> 4);
+	g |= p & (g >> 8); p &= (p >> 8);
+	g |= p & (g >> 16); p &= (p >> 16);
+	g |= p & (g >> 32);
+
+	return g;
+}
+
+/**
+ * Work out which of the WIDTH bytes of the block at BLK to keep
+ * from its whitespace (WS) and new line (NL) masks. Whatever was
+ * held back from the blocks before is written out to *DP first if
+ * it turns out to be in the middle of a line. Whitespace running
+ * off the end of the block is held back in turn.
+ */
+static inline __attribute__((__always_inline__)) uint64_t
+__trim_block(trim_t *st, const char *blk, uint64_t ws, uint64_t nl, int width, char **dp)
+{
+	uint64_t	full = (width == 64 ? ~0ULL : ((1ULL << width) - 1));
+	uint64_t	top = (1ULL << (width - 1));
+	uint64_t	other = (full & ~ws);
+	uint64_t	lead;
+	uint64_t	trail;
+	uint64_t	held;
+	int				nr;
+
+	if (st->nr_held)
+	{
+		if (!other)
+		{
+			__trim_hold(st, blk, width);
+			return 0;
+		}
+
+		/*
+		 * The first thing after the whitespace is a new
+		 * line, so the whitespace was trailing.
+		 */
+		if (nl & (other & -other))
+		{
+			st->nr_held = 0;
+		}
+		else
+		{
+			memcpy(*dp, st->held, st->nr_held);
+			*dp += st->nr_held;
+			st->nr_held = 0;
+		}
+	}
+
+	lead = __flood_up((((nl << 1) | (uint64_t)st->line_start) & ws), ws) & full;
+	trail = __flood_down(((nl >> 1) & ws), ws);
+	held = __flood_down((ws & top & ~lead), ws);
+
+	st->line_start = (((lead | nl) & top) != 0);
+
+	if (held)
+	{
+		nr = __builtin_popcountll(held);
+		__trim_hold(st, blk + (width - nr), nr);
+	}
+
+	return (full & ~(lead | trail | held));
+}
+
+__attribute__((__target__("ssse3,popcnt")))
+static size_t
+__trim_ssse3(trim_t *st, char *dst, const char *src, size_t len)
+{
+	const __m128i	spaces = _mm_set1_epi8(0x20);
+	const __m128i	tabs = _mm_set1_epi8(0x09);
+	const __m128i	nls = _mm_set1_epi8(0x0a);
+	__m128i		v;
+	uint32_t	ws;
+	uint32_t	nl;
+	uint32_t	keep;
+	char		*d = dst;
+	size_t	i;
+
+	for (i = 0; (i + 16) <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		ws = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, spaces), _mm_cmpeq_epi8(v, tabs)));
+		nl = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nls));
+
+		if (likely(!(ws | nl) && !st->nr_held))
+		{
+			keep = 0xffff;
+			st->line_start = 0;
+		}
+		else
+		{
+			keep = (uint32_t)__trim_block(st, src + i, ws, nl, 16, &d);
+		}
+
+		/*
+		 * Nothing has been dropped yet, so don't write (and
+		 * dirty the page) for the sake of it.
+		 */
+		if (keep == 0xffff && d == (src + i))
+		{
+			d += 16;
+			continue;
+		}
+
+		__compact16(v, keep, d);
+	}
+
+	return (d - dst) + __trim_scalar(st, d, src + i, len - i);
+}
+
+__attribute__((__target__("avx512f,avx512bw,avx512vbmi2,popcnt")))
+static size_t
+__squeeze_spaces_avx512(squeeze_t *st, char *dst, const char *src, size_t len)
+{
+	const __m512i	spaces = _mm512_set1_epi8(0x20);
+	__m512i		v;
+	uint64_t	s;
+	uint64_t	drop;
+	uint64_t	carry = (uint64_t)st->space;
+	char		*d = dst;
+	size_t	i;
+
+	for (i = 0; (i + 64) <= len; i += 64)
+	{
+		v = _mm512_loadu_si512((const void *)(src + i));
+		s = _mm512_cmpeq_epi8_mask(v, spaces);
+		drop = s & ((s << 1) | carry);
+		carry = (s >> 63);
+
+		_mm512_storeu_si512((void *)d, _mm512_maskz_compress_epi8(~drop, v));
+		d += 64 - __builtin_popcountll(drop);
+	}
+
+	st->space = (int)carry;
+	return (d - dst) + __squeeze_spaces_scalar(st, d, src + i, len - i);
+}
+
+__attribute__((__target__("avx512f,avx512bw,avx512vbmi2,popcnt")))
+static size_t
+__strip_cr_avx512(char *dst, const char *src, size_t len)
+{
+	const __m512i	crs = _mm512_set1_epi8(0x0d);
+	__m512i		v;
+	uint64_t	drop;
+	char		*d = dst;
+	size_t	i;
+
+	for (i = 0; (i + 64) <= len; i += 64)
+	{
+		v = _mm512_loadu_si512((const void *)(src + i));
+		drop = _mm512_cmpeq_epi8_mask(v, crs);
+
+		_mm512_storeu_si512((void *)d, _mm512_maskz_compress_epi8(~drop, v));
+		d += 64 - __builtin_popcountll(drop);
+	}
+
+	return (d - dst) + __strip_cr_scalar(d, src + i, len - i);
+}
+
+__attribute__((__target__("avx512f,avx512bw,avx512vbmi2,popcnt")))
+static size_t
+__trim_avx512(trim_t *st, char *dst, const char *src, size_t len)
+{
+	const __m512i	spaces = _mm512_set1_epi8(0x20);
+	const __m512i	tabs = _mm512_set1_epi8(0x09);
+	const __m512i	nls = _mm512_set1_epi8(0x0a);
+	__m512i		v;
+	uint64_t	ws;
+	uint64_t	nl;
+	uint64_t	keep;
+	char		*d = dst;
+	size_t	i;
+
+	for (i = 0; (i + 64) <= len; i += 64)
+	{
+		v = _mm512_loadu_si512((const void *)(src + i));
+		ws = _mm512_cmpeq_epi8_mask(v, spaces) | _mm512_cmpeq_epi8_mask(v, tabs);
+		nl = _mm512_cmpeq_epi8_mask(v, nls);
+
+		if (likely(!(ws | nl) && !st->nr_held))
+		{
+			keep = ~0ULL;
+			st->line_start = 0;
+		}
+		else
+		{
+			keep = __trim_block(st, src + i, ws, nl, 64, &d);
+		}
+
+		if (keep == ~0ULL && d == (src + i))
+		{
+			d += 64;
+			continue;
+		}
+
+		_mm512_storeu_si512((void *)d, _mm512_maskz_compress_epi8(keep, v));
+		d += __builtin_popcountll(keep);
+	}
+
+	return (d - dst) + __trim_scalar(st, d, src + i, len - i);
+}
+#endif
+
+/*
+ * Bitmaps of the spaces and new lines in LEN bytes of SRC, one
+ * bit per byte and 64 bytes per word. Bits past LEN are clear.
+ * The line wrapper reads these instead of the text itself.
+ */
+typedef void (*masks_fn_t)(const char *, size_t, uint64_t *, uint64_t *);
+
+multiversion
+static void
+__build_masks_portable(const char *src, size_t len, uint64_t *sp, uint64_t *nl)
+{
+	char		tail[64];
+	size_t	i;
+
+	for (i = 0; (i + 64) <= len; i += 64)
+	{
+		sp[i >> 6] = __eq_mask64(src + i, 0x20);
+		nl[i >> 6] = __eq_mask64(src + i, 0x0a);
+	}
+
+	if (i < len)
+	{
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, src + i, len - i);
+
+		sp[i >> 6] = __eq_mask64(tail, 0x20);
+		nl[i >> 6] = __eq_mask64(tail, 0x0a);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((__target__("avx512f,avx512bw")))
+static void
+__build_masks_avx512(const char *src, size_t len, uint64_t *sp, uint64_t *nl)
+{
+	__m512i		spaces = _mm512_set1_epi8(0x20);
+	__m512i		nls = _mm512_set1_epi8(0x0a);
+	__m512i		v;
+	__mmask64	tail;
+	size_t		i;
+
+	for (i = 0; (i + 64) <= len; i += 64)
+	{
+		v = _mm512_loadu_si512((const void *)(src + i));
+		sp[i >> 6] = _mm512_cmpeq_epi8_mask(v, spaces);
+		nl[i >> 6] = _mm512_cmpeq_epi8_mask(v, nls);
+	}
+
+	if (i < len)
+	{
+		tail = (1ULL << (len - i)) - 1;
+		v = _mm512_maskz_loadu_epi8(tail, (const void *)(src + i));
+		sp[i >> 6] = _mm512_mask_cmpeq_epi8_mask(tail, v, spaces);
+		nl[i >> 6] = _mm512_mask_cmpeq_epi8_mask(tail, v, nls);
+	}
+}
+#endif
+
+static squeeze_fn_t	squeeze_spaces = __squeeze_spaces_scalar;
+static strip_fn_t		strip_cr = __strip_cr_scalar;
+static trim_fn_t		trim_whitespace = __trim_scalar;
+static masks_fn_t		build_masks = __build_masks_portable;
+
+/**
+ * Pick the best versions of the kernels that the CPU can run.
+ * FTEXT_SIMD=scalar|ssse3|avx512 caps the choice, for testing
+ * and for comparing them.
+ */
+static void
+select_kernels(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	char	*cap = getenv("FTEXT_SIMD");
+
+	__init_compact_shuf();
+	__builtin_cpu_init();
+
+	if (cap && !strcmp(cap, "scalar"))
+		return;
+
+	if (__builtin_cpu_supports("avx512vbmi2") && __builtin_cpu_supports("avx512bw")
+	&& (!cap || !strcmp(cap, "avx512")))
+	{
+		squeeze_spaces = __squeeze_spaces_avx512;
+		strip_cr = __strip_cr_avx512;
+		trim_whitespace = __trim_avx512;
+		build_masks = __build_masks_avx512;
+		SIMD_LEVEL = "avx512";
+	}
+	else
+	if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt"))
+	{
+		squeeze_spaces = __squeeze_spaces_ssse3;
+		strip_cr = __strip_cr_ssse3;
+		trim_whitespace = __trim_ssse3;
+		SIMD_LEVEL = "ssse3";
+	}
+#endif
+}
+
+/*
+ * Turn each 0x0a into 0x0d,0x0a (--crlf). The file is extended
+ * once by the number of new lines and filled in backwards from
+ * the end, so that each byte is moved no more than once.
+ */
+static int
+__insert_cr(mapped_file_t *f)
+{
+	char	*startp = (char *)f->startp;
+	char	*src;
+	char	*dst;
+	char	*p;
+	size_t	size = f->current_file_size;
+	size_t	nr_lines;
+	size_t	longest;
+	size_t	len;
+
+	get_line_stats(f, &nr_lines, &longest);
+
+	if (!nr_lines)
+		return 0;
+
+	if (!__extend_file_and_map(f, (off_t)nr_lines))
+		return -1;
+
+	startp = (char *)f->startp;
+	src = (startp + size);
+	dst = (src + nr_lines);
+
+	while (dst > src)
+	{
+		p = memrchr(startp, 0x0a, src - startp);
+		len = (src - (p + 1));
+
+		dst -= len;
+		memmove(dst, p + 1, len);
+
+		*--dst = 0x0a;
+		*--dst = 0x0d;
+		src = p;
+	}
+
+	return 0;
+}
+
+/*
+ * Rejoin words that were broken across lines with "-\n". A hyphen
+ * at the end of a word is held back until we see whether a new
+ * line and then more text follow it; if they do, the hyphen and
+ * new line go (or just the new line, with --hyphens=hard) and the
+ * last space on the line before the word becomes the line break,
+ * so that the word moves down whole. FLOOR is how far back we have
+ * already looked for that space on the current output line, so
+ * that each output byte is looked at no more than once.
+ */
+#define HYPHEN_SOFT	0
+#define HYPHEN_HARD	1
+
+static int	HYPHEN_POLICY = HYPHEN_SOFT;
+
+typedef struct hyphen_t
+{
+	int		held;		/* 1: holding "-"; 2: holding "-\n" */
+	int		word;		/* last byte out was part of a word */
+	char	*floor;
+} hyphen_t;
+
+static void
+hyphen_init(hyphen_t *st, char *dst)
+{
+	clear_struct(st);
+	st->floor = dst;
+}
+
+static void
+__hyphen_rejoin(hyphen_t *st, char *d)
+{
+	char	*p;
+
+	for (p = d; p > st->floor && p[-1] != 0x0a; --p)
+	{
+		if (p[-1] == 0x20)
+		{
+			p[-1] = 0x0a;
+			break;
+		}
+	}
+
+	st->floor = d;
+}
+
+static size_t
+__hyphen_join(hyphen_t *st, char *dst, const char *src, size_t len)
+{
+	const char	*endp = (src + len);
+	const char	*p;
+	char				*d = dst;
+	char				c;
+
+	while (src < endp)
+	{
+		if (!st->held)
+		{
+			if (!(p = memchr(src, 0x2d, endp - src)))
+				p = endp;
+
+			if (p > src)
+			{
+				if (d != src)
+					memmove(d, src, p - src);
+
+				d += (p - src);
+				st->word = !is_blank(p[-1]) && p[-1] != 0x0a;
+				src = p;
+			}
+
+			if (src == endp)
+				break;
+
+			/*
+			 * A hyphen with a word in front of it.
+			 */
+			++src;
+			if (st->word)
+			{
+				st->held = 1;
+			}
+			else
+			{
+				*d++ = 0x2d;
+				st->word = 1;
+			}
+
+			continue;
+		}
+
+		c = *src;
+
+		if (st->held == 1 && c == 0x0a)
+		{
+			st->held = 2;
+			++src;
+			continue;
+		}
+
+		if (st->held == 2 && c != 0x0a)
+		{
+			if (HYPHEN_POLICY == HYPHEN_HARD)
+				*d++ = 0x2d;
+
+			__hyphen_rejoin(st, d);
+			st->word = 1;
+		}
+		else
+		{
+			*d++ = 0x2d;
+			if (st->held == 2)
+				*d++ = 0x0a;
+
+			st->word = (st->held == 1);
+		}
+
+		st->held = 0;
+	}
+
+	return (d - dst);
+}
+
+/*
+ * End of input: put back whatever is still held.
+ */
+static size_t
+hyphen_finish(hyphen_t *st, char *dst)
+{
+	char	*d = dst;
+
+	if (st->held)
+		*d++ = 0x2d;
+	if (st->held == 2)
+		*d++ = 0x0a;
+
+	st->held = 0;
+	return (d - dst);
+}
+
+/*
+ * Normalise the text in one pass, a block at a time: strip the
+ * 0x0d's, trim the whitespace from both ends of each line, squeeze
+ * runs of spaces and rejoin hyphenated words. Every stage works in
+ * place and never writes more than it has read, so each one can
+ * write its output over the input of the one before it, and a block
+ * goes through all of them while it is still in the cache. The SIZE
+ * bytes at STARTP are at offset BASE in the file, for the progress
+ * bar.
+ */
+#define NORMALISE_BLOCK	(64 * 1024)
+
+static int
+__normalise_buf(char *startp, size_t size, size_t base, size_t *out_len)
+{
+	char			*out[4] = { startp, startp, startp, startp };
+	char			*in;
+	size_t		off;
+	size_t		len;
+	size_t		n;
+	trim_t		trim;
+	squeeze_t	squeeze;
+	hyphen_t	hyphen;
+
+	trim_init(&trim);
+	clear_struct(&squeeze);
+	hyphen_init(&hyphen, startp);
+
+	probe2(normalise__start, (const char *)"text", size);
+
+	for (off = 0; off < size; off += len)
+	{
+		len = (size - off);
+		if (len > NORMALISE_BLOCK)
+			len = NORMALISE_BLOCK;
+
+		/*
+		 * Most files have no 0x0d's at all, so don't
+		 * dirty any pages unless we have to.
+		 */
+		in = (startp + off);
+		if (out[0] == in && !memchr(in, 0x0d, len))
+			n = len;
+		else
+			n = strip_cr(out[0], in, len);
+
+		in = out[0];
+		out[0] += n;
+
+		n = trim_whitespace(&trim, out[1], in, n);
+		in = out[1];
+		out[1] += n;
+
+		n = squeeze_spaces(&squeeze, out[2], in, n);
+		in = out[2];
+		out[2] += n;
+
+		out[3] += __hyphen_join(&hyphen, out[3], in, n);
+
+		progress_update(base + off + len, 0);
+	}
+
+	out[3] += hyphen_finish(&hyphen, out[3]);
+
+	if (trim_finish(&trim) < 0)
+	{
+		fprintf(stderr, "__normalise_buf: failed to allocate memory (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	*out_len = (size_t)(out[3] - startp);
+	probe2(normalise__end, (const char *)"text", *out_len);
+
+	return 0;
+}
+
+static int
+__normalise_file(mapped_file_t *f)
+{
+	size_t	len;
+
+	if (__normalise_buf((char *)f->startp, f->current_file_size, 0, &len) < 0)
+		return -1;
+
+	return __truncate_file(f, len);
+}
+
+/*
+ * Map the SIZE bytes of the file open on F->FD.
+ */
+static mapped_file_t *
+__map_fd(mapped_file_t *f, size_t size)
+{
+	int		flags;
+
+	f->map_size = f->current_file_size = f->original_file_size = size;
+
+	flags = 0;
+	flags |= MAP_SHARED;
+
+	if ((f->startp = mmap(NULL, f->original_file_size, PROT_READ|PROT_WRITE, flags, f->fd, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "map_file: mmap error (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	f->flags = flags;
+	f->endp = (void *)((char *)f->startp + size);
+
+	probe3(map, (const char *)f->filename, f->original_file_size, f->startp);
+
+	return f;
+}
+
+/**
+ * Map file into virtual memory.
+ */
+static mapped_file_t *
+map_file(mapped_file_t *f)
+{
+	assert(f);
+
+	char		*filename = f->filename;
+	struct stat statb;
+
+	clear_struct(&statb);
+	if (lstat(filename, &statb) < 0)
+	{
+		fprintf(stderr, "map_file: lstat error (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	if ((f->fd = open(filename, O_RDWR)) < 0)
+	{
+		fprintf(stderr, "map_file: open error (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	return __map_fd(f, statb.st_size);
+}
+
+/*
+ * Map the file NAME to read only, for the modes that change
+ * nothing. An empty file maps as NULL.
+ */
+static int
+map_input(const char *name, const char **p, size_t *size)
+{
+	struct stat	statb;
+	void				*m = NULL;
+	int					fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &statb) < 0)
+	{
+		fprintf(stderr, "map_input: failed to open %s (%s)\n", name, strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	if (statb.st_size
+	&& (m = mmap(NULL, statb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "map_input: mmap error (%s)\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	*p = (const char *)m;
+	*size = (size_t)statb.st_size;
+
+	return 0;
+}
+
+/**
+ * Unmap file from virtual memory.
+ */
+static void
+unmap_file(mapped_file_t *f)
+{
+	assert(f);
+
+	probe3(unmap, (const char *)f->filename, f->current_file_size, f->startp);
+	munmap(f->startp, f->map_size);
+
+	if (f->fd > 2)
+		close(f->fd);
+
+	clear_struct(f);
+
+	return;
+}
+
+static int
+check_file(char *filename)
+{
+	struct stat	statb;
+
+	if (access(filename, F_OK) != 0)
+	{
+		fprintf(stderr, "check_file: %s does not exist\n", filename);
+		goto fail;
+	}
+	else
+	if (access(filename, R_OK) != 0)
+	{
+		fprintf(stderr, "check_file: cannot read %s\n", filename);
+		goto fail;
+	}
+	else
+	if (!(user_options & (ANALYSE|DRY_RUN)) && access(filename, W_OK) != 0)
+	{
+		fprintf(stderr, "check_file: cannot write to %s\n", filename);
+		goto fail;
+	}
+
+	clear_struct(&statb);
+	if (lstat(filename, &statb) < 0)
+	{
+		fprintf(stderr, "check_file: lstat error (%s)\n", strerror(errno));
+		goto fail;
+	}
+
+	if (!S_ISREG(statb.st_mode))
+	{
+		fprintf(stderr, "check_file: %s is not a regular file\n", filename);
+		goto fail;
+	}
+
+	return 0;
+
+	fail:
+	return -1;
+}
+
+/*
+ * The line wrapper reads the input through bitmaps of its spaces
+ * and new lines, WRAP_WINDOW bytes of input at a time. BASE is
+ * the (64-aligned) offset of the first byte they cover and END
+ * the offset after the last.
+ */
+#define WRAP_WINDOW	(64 * 1024)
+
+typedef struct wrap_t
+{
+	size_t		base;
+	size_t		end;
+	size_t		words;
+	uint64_t	*sp;
+	uint64_t	*nl;
+} wrap_t;
+
+/*
+ * Offset of the first bit set in M within [A,B], or -1.
+ */
+static inline long
+__mask_first(const uint64_t *m, size_t a, size_t b)
+{
+	size_t		wa = (a >> 6);
+	size_t		wb = (b >> 6);
+	uint64_t	w;
+
+	if (a > b)
+		return -1;
+
+	w = m[wa] & (~0ULL << (a & 63));
+
+	for (;;)
+	{
+		if (wa == wb)
+			w &= ((2ULL << (b & 63)) - 1);
+		if (w)
+			return (long)((wa << 6) + __builtin_ctzll(w));
+		if (wa == wb)
+			return -1;
+
+		w = m[++wa];
+	}
+}
+
+/*
+ * Offset of the last bit set in M1|M2 within [A,B], or -1.
+ */
+static inline long
+__mask_last(const uint64_t *m1, const uint64_t *m2, size_t a, size_t b)
+{
+	size_t		wa = (a >> 6);
+	size_t		wb = (b >> 6);
+	uint64_t	w;
+
+	if (a > b)
+		return -1;
+
+	w = (m1[wb] | m2[wb]) & ((2ULL << (b & 63)) - 1);
+
+	for (;;)
+	{
+		if (wa == wb)
+			w &= (~0ULL << (a & 63));
+		if (w)
+			return (long)((wb << 6) + 63 - __builtin_clzll(w));
+		if (wa == wb)
+			return -1;
+
+		--wb;
+		w = (m1[wb] | m2[wb]);
+	}
+}
+
+/*
+ * Line lengths that nearly every job asks for. The wrap and justify
+ * engines are inlined into a version of their own for each of them,
+ * with the width a constant, and any other width goes through the
+ * generic version.
+ */
+#define SPECIALISED_WIDTHS(X) X(72) X(76) X(80) X(100)
+
+#define always_inline inline __attribute__((__always_inline__))
+
+/*
+ * The 128 bits of M from offset A on, as two words.
+ */
+static inline void
+__mask_window(const uint64_t *m, size_t a, uint64_t *lo, uint64_t *hi)
+{
+	const uint64_t	*p = (m + (a >> 6));
+	unsigned int		sh = (a & 63);
+
+	if (sh)
+	{
+		*lo = (p[0] >> sh) | (p[1] << (64 - sh));
+		*hi = (p[1] >> sh) | (p[2] << (64 - sh));
+	}
+	else
+	{
+		*lo = p[0];
+		*hi = p[1];
+	}
+}
+
+/*
+ * Everything the wrap needs to know about a line that starts at
+ * offset A, when WIDTH is below WRAP_FAST_WIDTH and the line and
+ * the byte after it lie inside the bitmaps: *PARA is the offset of
+ * the first new line in [A,A+WIDTH] with another after it (or -1),
+ * and we return the offset of the last space or new line within
+ * [A+1,A+WIDTH] (or -1). With WIDTH a constant, the masks are too.
+ */
+#define WRAP_FAST_WIDTH	127
+
+static always_inline long
+__wrap_scan(const wrap_t *w, size_t a, size_t width, long *para)
+{
+	uint64_t	sp0, sp1;
+	uint64_t	nl0, nl1;
+	uint64_t	p0, p1;
+	uint64_t	lim0 = (width >= 63 ? ~0ULL : ((2ULL << width) - 1));
+	uint64_t	lim1 = (width >= 64 ? ((2ULL << (width - 64)) - 1) : 0);
+
+	__mask_window(w->sp, a, &sp0, &sp1);
+	__mask_window(w->nl, a, &nl0, &nl1);
+
+	p0 = nl0 & ((nl0 >> 1) | (nl1 << 63)) & lim0;
+	p1 = nl1 & (nl1 >> 1) & lim1;
+
+	if (p0)
+		*para = (long)(a + __builtin_ctzll(p0));
+	else
+	if (p1)
+		*para = (long)(a + 64 + __builtin_ctzll(p1));
+	else
+		*para = -1;
+
+	sp0 = (sp0 | nl0) & lim0 & ~1ULL;
+	sp1 = (sp1 | nl1) & lim1;
+
+	if (sp1)
+		return (long)(a + 127 - __builtin_clzll(sp1));
+	if (sp0)
+		return (long)(a + 63 - __builtin_clzll(sp0));
+
+	return -1;
+}
+
+static void
+__wrap_load(wrap_t *w, const char *in, size_t size, size_t from)
+{
+	w->base = (from & ~(size_t)63);
+	w->end = (w->base + (w->words << 6));
+
+	if (w->end > size)
+		w->end = size;
+
+	build_masks(in + w->base, w->end - w->base, w->sp, w->nl);
+}
+
+/*
+ * Pass the input up to END through to the output, with
+ * the new lines in it turned into spaces.
+ */
+static int
+__wrap_join(sink_t *s, wrap_t *w, size_t end, size_t *lines)
+{
+	long	q;
+
+	while (s->rd < end && (q = __mask_first(w->nl, s->rd - w->base, end - 1 - w->base)) >= 0)
+	{
+		sink_copy(s, (q + w->base) - s->rd);
+		sink_skip(s, 1);
+
+		if (sink_put(s, " ", 1) < 0)
+			return -1;
+
+		++*lines;
+	}
+
+	if (end > s->rd)
+		sink_copy(s, end - s->rd);
+
+	return 0;
+}
+
+/*
+ * Where a wrap has got to. Keeping it out of the loop lets a pass
+ * be fed its input a block at a time, so that several of them can
+ * take turns over the same input while it is still in the cache.
+ */
+typedef struct wrap_state_t
+{
+	sink_t		s;
+	wrap_t		w;
+	size_t		line;
+	size_t		lines;
+} wrap_state_t;
+
+/*
+ * Set up a wrap to MAX_LENGTH over the input of the sink,
+ * which the caller has already initialised, from where the
+ * sink has got to.
+ */
+static int
+__wrap_begin(wrap_state_t *st, size_t max_length)
+{
+	wrap_t	*w = &st->w;
+
+	st->line = st->s.rd;
+	st->lines = sink_lines(&st->s);
+
+	clear_struct(w);
+	w->words = (((max_length > WRAP_WINDOW ? max_length : WRAP_WINDOW) + 128) >> 6);
+
+	/*
+	 * Two spare words after each bitmap, as __mask_window() reads
+	 * three words from the one the line starts in, which can be
+	 * the last.
+	 */
+	if (!(w->sp = calloc((w->words + 2) * 2, sizeof(uint64_t))))
+	{
+		fprintf(stderr, "__wrap_begin: failed to allocate memory (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	w->nl = (w->sp + w->words + 2);
+	probe1(paragraph__start, (long)0);
+
+	return 0;
+}
+
+static int
+__wrap_finish(wrap_state_t *st)
+{
+	free(st->w.sp);
+
+	probe2(paragraph__end, (long)st->s.in_size, st->lines);
+	progress_update(st->s.in_size, st->lines);
+
+	return sink_finish(&st->s);
+}
+
+/*
+ * Wrap the text to MAX_LENGTH bytes per line in one pass from the
+ * front, starting lines until one starts at or beyond UPTO. Each
+ * line breaks at the last space or new line that fits, found from
+ * the bitmaps in O(1) rather than by walking back over the line,
+ * and the input is only looked at again when it has to be moved up
+ * to make room for a hyphen.
+ */
+static always_inline int
+__wrap_engine(wrap_state_t *st, size_t upto, size_t max_length)
+{
+	sink_t			*s = &st->s;
+	wrap_t			*w = &st->w;
+	const char	*in;
+	const char	*brk;
+	size_t			size = s->in_size;
+	size_t			line = st->line;
+	size_t			last;
+	size_t			cut;
+	size_t			p = 0;
+	size_t			lines = st->lines;
+	long				q;
+	long				brk_at = -1;
+	int					fast;
+
+	if (upto > size)
+		upto = size;
+
+	while (line < upto)
+	{
+		sink_mark(s, lines);
+		last = (line + max_length);
+
+		if (last >= size)
+			last = (size - 1);
+
+		if (last >= w->end)
+		{
+			__wrap_load(w, sink_input(s), size, line);
+			progress_update(line, lines);
+		}
+
+		in = sink_input(s);
+		fast = (max_length < WRAP_FAST_WIDTH && (line + max_length + 1) < w->end);
+
+		/*
+		 * We want to preserve paragraph structure, so if
+		 * we encounter two or more consecutive new lines
+		 * (or the one at the end of the file) we keep them
+		 * all and start a new line after them.
+		 */
+		if (fast)
+		{
+			brk_at = __wrap_scan(w, line - w->base, max_length, &q);
+			p = (q + w->base);
+		}
+		else
+		for (q = __mask_first(w->nl, line - w->base, last - w->base); q >= 0;
+			q = __mask_first(w->nl, q + 1, last - w->base))
+		{
+			p = (q + w->base);
+
+			if ((p + 1) == size || in[p + 1] == 0x0a)
+				break;
+		}
+
+		if (q >= 0)
+		{
+			if (__wrap_join(s, w, p, &lines) < 0)
+				goto fail;
+
+			probe2(paragraph__end, (long)p, lines);
+
+			/*
+			 * A checkpoint can move the input.
+			 */
+			in = sink_input(s);
+
+			for (cut = p; cut < size && in[cut] == 0x0a; ++cut)
+				++lines;
+
+			sink_copy(s, cut - p);
+			line = cut;
+
+			if (line < size)
+				probe1(paragraph__start, (long)line);
+
+			continue;
+		}
+
+		/*
+		 * The rest of a file with no new line at the end.
+		 */
+		if ((line + max_length) >= size)
+		{
+			if (__wrap_join(s, w, size, &lines) < 0)
+				goto fail;
+
+			line = size;
+			break;
+		}
+
+		q = (fast ? brk_at : __mask_last(w->sp, w->nl, line + 1 - w->base, line + max_length - w->base));
+
+		if (likely(q >= 0))
+		{
+			p = (q + w->base);
+
+			if (__wrap_join(s, w, p, &lines) < 0)
+				goto fail;
+
+			sink_skip(s, 1);
+			if (sink_put(s, "\n", 1) < 0)
+				goto fail;
+
+			++lines;
+			line = (p + 1);
+			continue;
+		}
+
+		/*
+		 * Then we have a line with no whitespace. Break the
+		 * word after a hyphen if there is one at the end of
+		 * the line; otherwise break it MAX_LENGTH-1 bytes in
+		 * and add a hyphen of our own.
+		 */
+		if (unlikely(in[line + max_length - 1] == 0x2d))
+		{
+			cut = (line + max_length);
+			brk = "\n";
+		}
+		else
+		if (unlikely(in[line + max_length - 2] == 0x2d))
+		{
+			cut = (line + max_length - 1);
+			brk = "\n";
+		}
+		else
+		{
+			cut = (line + max_length - 1);
+			brk = "-\n";
+		}
+
+		if (__wrap_join(s, w, cut, &lines) < 0 || sink_put(s, brk, strlen(brk)) < 0)
+			goto fail;
+
+		line = cut;
+	}
+
+	st->line = line;
+	st->lines = lines;
+
+	return 0;
+
+	fail:
+	st->line = line;
+	st->lines = lines;
+
+	return -1;
+}
+
+#define __WRAP_WIDTH(w)																						\
+_Static_assert((w) >= 2 && (w) < WRAP_FAST_WIDTH, "bad width");		\
+static int																												\
+__wrap_##w(wrap_state_t *st, size_t upto)													\
+{																																	\
+	return __wrap_engine(st, upto, (w));														\
+}
+SPECIALISED_WIDTHS(__WRAP_WIDTH)
+#undef __WRAP_WIDTH
+
+static int
+__wrap_generic(wrap_state_t *st, size_t upto, size_t max_length)
+{
+	return __wrap_engine(st, upto, max_length);
+}
+
+static int
+__wrap_step(wrap_state_t *st, size_t upto, int max_length)
+{
+#define __WRAP_CASE(w) case(w): return __wrap_##w(st, upto);
+	switch(max_length)
+	{
+		SPECIALISED_WIDTHS(__WRAP_CASE)
+		default:
+		return __wrap_generic(st, upto, (size_t)max_length);
+	}
+#undef __WRAP_CASE
+}
+
+static int
+change_line_length(mapped_file_t *file)
+{
+	assert(file);
+
+	wrap_state_t	st;
+
+	sink_init(&st.s, file);
+
+	if (__wrap_begin(&st, (size_t)MAX_LENGTH) < 0)
+		return -1;
+
+	if (__wrap_step(&st, file->current_file_size, MAX_LENGTH) < 0)
+	{
+		free(st.w.sp);
+		return -1;
+	}
+
+	return __wrap_finish(&st);
+}
+
+/*
+ * Fold LEN bytes at P, the first of which is in COLUMN, to WIDTH
+ * bytes per line, writing the output backwards from END. A new
+ * line goes in before each byte whose column is a multiple of
+ * WIDTH, bar the first, without any regard for words. END may be
+ * in the input itself so long as the output is never below it,
+ * which is what lets the file be folded in place.
+ */
+static void
+__fold_back(const char *p, size_t len, size_t column, size_t width, char *end)
+{
+	const char	*nl;
+	size_t			seg;
+	size_t			col;
+	size_t			k;
+
+	while (len)
+	{
+		nl = memrchr(p, 0x0a, len);
+		seg = (nl ? (size_t)((p + len) - (nl + 1)) : len);
+		col = (nl ? 0 : column);
+
+		/*
+		 * The last line, or what there is of it, in bytes
+		 * [LEN-SEG,LEN), one cut at a time from its end.
+		 */
+		while (seg)
+		{
+			k = (((col + seg - 1) / width) * width);
+
+			if (!k || k < col)
+			{
+				end -= seg;
+				memmove(end, p + len - seg, seg);
+				len -= seg;
+				break;
+			}
+
+			end -= (seg - (k - col));
+			memmove(end, p + len - (seg - (k - col)), seg - (k - col));
+			*--end = 0x0a;
+
+			len -= (seg - (k - col));
+			seg = (k - col);
+		}
+
+		if (nl)
+		{
+			*--end = 0x0a;
+			len = (size_t)(nl - p);
+		}
+	}
+}
+
+typedef struct fold_job_t
+{
+	pthread_t			tid;
+	int						started;
+	const char		*p;
+	size_t				len;
+	size_t				column;		/* of the first byte */
+	size_t				width;
+	line_stats_t	st;
+	char					*out;			/* where the piece is folded to */
+	size_t				out_len;
+	size_t				out_off;	/* and where it goes in the file */
+} fold_job_t;
+
+static void *
+__fold_scan_worker(void *arg)
+{
+	fold_job_t	*job = (fold_job_t *)arg;
+
+	__line_stats_scan(&job->st, job->p, job->len, job->width);
+	return NULL;
+}
+
+static void *
+__fold_worker(void *arg)
+{
+	fold_job_t	*job = (fold_job_t *)arg;
+
+	__fold_back(job->p, job->len, job->column, job->width, job->out + job->out_len);
+	return NULL;
+}
+
+/*
+ * Run FN over each of the jobs, the first in this thread and
+ * the others in threads of their own if we can have them.
+ */
+static void
+__fold_run(fold_job_t *jobs, int nr_jobs, void *(*fn)(void *))
+{
+	int		i;
+
+	for (i = 1; i < nr_jobs; ++i)
+	{
+		if (!(jobs[i].started = (pthread_create(&jobs[i].tid, NULL, fn, (void *)&jobs[i]) == 0)))
+			fn((void *)&jobs[i]);
+	}
+
+	fn((void *)&jobs[0]);
+
+	for (i = 1; i < nr_jobs; ++i)
+	{
+		if (jobs[i].started)
+			pthread_join(jobs[i].tid, NULL);
+	}
+}
+
+/*
+ * Cut the lines every FOLD_WIDTH bytes (--fold), for readers that
+ * want fixed-width lines and don't care for words. The pieces of
+ * the file are scanned in parallel for where their new lines fall,
+ * a prefix sum over them then gives the column each piece starts
+ * in and where its output goes, and so each can be folded on its
+ * own: into a buffer of its own when there are several, then
+ * copied into place, or else in place from the back.
+ */
+static int
+fold_text(mapped_file_t *file)
+{
+	assert(file);
+
+	fold_job_t	jobs[LINE_STATS_MAX_PIECES];
+	size_t			size = file->current_file_size;
+	size_t			width = (size_t)FOLD_WIDTH;
+	size_t			column = 0;
+	size_t			out = 0;
+	size_t			lines = 0;
+	int					nr_pieces = __nr_pieces(size);
+	size_t			piece = (size / nr_pieces);
+	int					i;
+
+	for (i = 0; i < nr_pieces; ++i)
+	{
+		clear_struct(&jobs[i]);
+		jobs[i].p = ((const char *)file->startp + (i * piece));
+		jobs[i].len = (i == (nr_pieces - 1) ? size - (i * piece) : piece);
+		jobs[i].width = width;
+	}
+
+	__fold_run(jobs, nr_pieces, __fold_scan_worker);
+
+	for (i = 0; i < nr_pieces; ++i)
+	{
+		line_stats_t	*st = &jobs[i].st;
+
+		jobs[i].column = column;
+		jobs[i].out_off = out;
+		jobs[i].out_len = jobs[i].len + st->folds + __fold_count(column, st->prefix, width);
+
+		if (st->lines)
+		{
+			jobs[i].out_len += __fold_count(0, st->suffix, width);
+			column = st->suffix;
+		}
+		else
+		{
+			column += jobs[i].len;
+		}
+
+		out += jobs[i].out_len;
+		lines += st->lines;
+	}
+
+	progress_update(size / 2, lines);
+
+	if (out == size)
+		goto done;
+
+	for (i = 0; nr_pieces > 1 && i < nr_pieces; ++i)
+	{
+		if (!(jobs[i].out = malloc(jobs[i].out_len)))
+			break;
+	}
+
+	/*
+	 * Without the memory for a copy of each piece,
+	 * do the whole file in place instead.
+	 */
+	if (nr_pieces > 1 && i < nr_pieces)
+	{
+		while (i > 0)
+			free(jobs[--i].out);
+
+		nr_pieces = 1;
+		jobs[0].len = size;
+	}
+
+	if (nr_pieces > 1)
+	{
+		__fold_run(jobs, nr_pieces, __fold_worker);
+
+		if (!__extend_file_and_map(file, (off_t)(out - size)))
+			goto fail;
+
+		for (i = 0; i < nr_pieces; ++i)
+		{
+			memcpy((char *)file->startp + jobs[i].out_off, jobs[i].out, jobs[i].out_len);
+			free(jobs[i].out);
+		}
+	}
+	else
+	{
+		if (!__extend_file_and_map(file, (off_t)(out - size)))
+			return -1;
+
+		__fold_back((const char *)file->startp, size, 0, width, (char *)file->startp + out);
+	}
+
+	done:
+	progress_update(size, lines);
+	return 0;
+
+	fail:
+	for (i = 0; i < nr_pieces; ++i)
+		free(jobs[i].out);
+
+	return -1;
+}
+
+/*
+ * Split the lines longer than MAX_LENGTH (--split-only) and pass
+ * all the others through as they are. A long line is broken at
+ * the last space that fits, which becomes the new line, or cut at
+ * MAX_LENGTH if it has none, so no bytes are added but the new
+ * lines. Until the first cut without a space, the output sits
+ * where the input was, so the sink copies nothing and the only
+ * bytes written are the spaces that are turned into new lines.
+ */
+static int
+split_long_lines(mapped_file_t *file)
+{
+	assert(file);
+
+	sink_t			s;
+	const char	*in;
+	const char	*nl;
+	const char	*sp;
+	size_t			size = file->current_file_size;
+	size_t			width = (size_t)MAX_LENGTH;
+	size_t			line = 0;
+	size_t			end;
+	size_t			lines = 0;
+
+	sink_init(&s, file);
+
+	while (line < size)
+	{
+		in = sink_input(&s);
+		nl = memchr(in + line, 0x0a, size - line);
+		end = (nl ? (size_t)(nl - in) : size);
+
+		while ((end - line) > width)
+		{
+			in = sink_input(&s);
+			sp = memrchr(in + line + 1, 0x20, width);
+
+			if (sp)
+			{
+				sink_copy(&s, (size_t)(sp - in) - s.rd);
+				sink_skip(&s, 1);
+
+				if (sink_put(&s, "\n", 1) < 0)
+					return -1;
+
+				line = (size_t)(sp - in) + 1;
+			}
+			else
+			{
+				sink_copy(&s, (line + width) - s.rd);
+
+				if (sink_put(&s, "\n", 1) < 0)
+					return -1;
+
+				line += width;
+			}
+
+			++lines;
+		}
+
+		line = (nl ? end + 1 : size);
+		sink_copy(&s, line - s.rd);
+
+		++lines;
+		progress_update(line, lines);
+	}
+
+	return sink_finish(&s);
+}
+
+/*
+ * Justify each line to WIDTH bytes in one pass from the front,
+ * spreading the spaces it is short of over the gaps between its
+ * words. Every gap gets the same number, and any left over go one
+ * each to the gaps nearest the two ends, starting from the left.
+ * Lines that are full already, too long, or no longer than half
+ * the width are passed through as they are. It starts from
+ * wherever the sink, which the caller has set up, has got to.
+ */
+static always_inline int
+__justify_engine(sink_t *s, size_t width)
+{
+	const char	*in;
+	const char	*nl;
+	size_t			size = s->in_size;
+	size_t			line = s->rd;
+	size_t			end;
+	size_t			len;
+	size_t			p;
+	size_t			holes;
+	size_t			hole;
+	size_t			delta;
+	size_t			quotient;
+	size_t			left;
+	size_t			right;
+	size_t			lines = sink_lines(s);
+
+	while (line < size)
+	{
+		sink_mark(s, lines);
+		progress_update(line, lines);
+
+		in = sink_input(s);
+		nl = memchr(in + line, 0x0a, size - line);
+		end = (nl ? (size_t)(nl - in) : size);
+		len = (end - line);
+
+		/*
+		 * Short lines with more spaces than there are
+		 * letters are not aesthetically pleasing. So
+		 * just leave them alone.
+		 */
+		if (len > (width / 2) && len < width)
+		{
+			for (holes = 0, p = line; p < end; ++p)
+			{
+				if (in[p] == 0x20 && (p == line || in[p - 1] != 0x20))
+					++holes;
+			}
+
+			if (holes)
+			{
+				delta = (width - len);
+				quotient = (delta / holes);
+				left = (((delta % holes) + 1) / 2);
+				right = (holes - ((delta % holes) / 2));
+
+				for (hole = 0, p = line; p < end; ++p)
+				{
+					if (in[p] != 0x20 || ((p + 1) < end && in[p + 1] == 0x20))
+						continue;
+
+					sink_copy(s, (p + 1) - s->rd);
+
+					if (sink_fill(s, 0x20, quotient + (hole < left) + (hole >= right)) < 0)
+						return -1;
+
+					in = sink_input(s);
+					++hole;
+				}
+			}
+		}
+
+		for (p = end; p < size && in[p] == 0x0a; ++p)
+			++lines;
+
+		sink_copy(s, p - s->rd);
+		line = p;
+	}
+
+	progress_update(size, lines);
+
+	return sink_finish(s);
+}
+
+#define __JUSTIFY_WIDTH(w)																				\
+static int																												\
+__justify_##w(sink_t *s)																					\
+{																																	\
+	return __justify_engine(s, (w));																\
+}
+SPECIALISED_WIDTHS(__JUSTIFY_WIDTH)
+#undef __JUSTIFY_WIDTH
+
+static int
+__justify_generic(sink_t *s, size_t width)
+{
+	return __justify_engine(s, width);
+}
+
+static int
+__justify_step(sink_t *s, int width)
+{
+#define __JUSTIFY_CASE(w) case(w): return __justify_##w(s);
+	switch(width)
+	{
+		SPECIALISED_WIDTHS(__JUSTIFY_CASE)
+		default:
+		return __justify_generic(s, (size_t)width);
+	}
+#undef __JUSTIFY_CASE
+}
+
+/*
+ * The width to align to: the line length if the user gave
+ * one, or else that of the longest line (which --dry-run
+ * works out for the whole file first, as it formats it a
+ * piece at a time).
+ */
+static int
+__align_width(mapped_file_t *file)
+{
+	if (test_flag(LENGTH))
+		return MAX_LENGTH;
+
+	if (file->width)
+		return file->width;
+
+	return __get_length_longest_line(file);
+}
+
+static int
+justify_text(mapped_file_t *file)
+{
+	assert(file);
+
+	sink_t	s;
+	int			width = __align_width(file);
+
+	sink_init(&s, file);
+
+	return __justify_step(&s, width);
+}
+
+static int
+unjustify_text(mapped_file_t *file)
+{
+	assert(file);
+
+	/*
+	 * Spaces are squeezed in __normalise_file()
+	 */
+	progress_update(file->current_file_size, 0);
+
+	return 0;
+}
+
+static int
+left_align_text(mapped_file_t *file)
+{
+	assert(file);
+
+	progress_update(file->current_file_size, 0);
+
+	return 0;
+}
+
+/*
+ * Pad the front of each line with spaces out to the width to align
+ * to (or half way there, to centre it), through a sink so that the
+ * lines after it are only moved up the once.
+ */
+static int
+__pad_lines(mapped_file_t *file, int centre)
+{
+	sink_t			s;
+	const char	*in;
+	const char	*nl;
+	size_t			size;
+	size_t			line;
+	size_t			end;
+	size_t			lines = 0;
+	int					width = __align_width(file);
+	int					delta;
+
+	sink_init(&s, file);
+	size = s.in_size;
+
+	for (line = 0; line < size; line = end)
+	{
+		in = sink_input(&s);
+
+		if ((nl = memchr(in + line, 0x0a, size - line)))
+			end = (size_t)(nl - in);
+		else
+			end = size;
+
+		delta = (width - (int)(end - line));
+
+		if (centre)
+			delta = ((delta / 2) + (delta % 2));
+
+		if (delta > 0 && sink_fill(&s, 0x20, (size_t)delta) < 0)
+			return -1;
+
+		/*
+		 * The fill can move the input.
+		 */
+		in = sink_input(&s);
+
+		while (end < size && in[end] == 0x0a)
+		{
+			++end;
 			++lines;
+		}
+
+		sink_copy(&s, end - line);
+		progress_update(end, lines);
+	}
+
+	return sink_finish(&s);
+}
+
+static int
+right_align_text(mapped_file_t *file)
+{
+	assert(file);
+
+	return __pad_lines(file, 0);
+}
+
+static int
+centre_align_text(mapped_file_t *file)
+{
+	assert(file);
+
+	return __pad_lines(file, 1);
+}
+
+/**
+ * Run one formatting operation over the file, publishing
+ * the phase it is in for the progress thread.
+ */
+static int
+__run_phase(mapped_file_t *f, int phase, int (*formatter)(mapped_file_t *))
+{
+	int		ret;
+
+	f->grow_hint = (f->growth ? f->growth[phase] : 0);
+
+	begin_phase(phase, f->current_file_size);
+	ret = formatter(f);
+	acct_output(f->current_file_size);
+	end_phase(ret);
+
+	f->grow_hint = 0;
+
+	return ret;
+}
+
+static int
+normalise_text(mapped_file_t *file)
+{
+	assert(file);
+
+	/*
+	 * Remove 0x0d's, remove "-\n"
+	 */
+	return __normalise_file(file);
+}
+
+/*
+ * The formatter and phase for each alignment.
+ */
+static const struct
+{
+	uint32_t	flag;
+	int				phase;
+	int				(*formatter)(mapped_file_t *);
+} alignments[] =
+{
+	{ JUSTIFY, PHASE_JUSTIFY, justify_text },
+	{ UNJUSTIFY, PHASE_UNJUSTIFY, unjustify_text },
+	{ LALIGN, PHASE_LALIGN, left_align_text },
+	{ RALIGN, PHASE_RALIGN, right_align_text },
+	{ CALIGN, PHASE_CALIGN, centre_align_text }
+};
+
+#define NR_ALIGNMENTS (sizeof(alignments) / sizeof(alignments[0]))
+
+/**
+ * The steps that follow the change of line length: the alignment
+ * the user asked for, and then the line endings.
+ */
+static int
+__align_file(mapped_file_t *f)
+{
+	size_t	i;
+
+	for (i = 0; i < NR_ALIGNMENTS; ++i)
+	{
+		if (test_flag(alignments[i].flag)
+		&& __run_phase(f, alignments[i].phase, alignments[i].formatter) == -1)
+			return -1;
+	}
+
+	/*
+	 * Everything works on plain new lines, so
+	 * only put the CRs in once we have finished.
+	 */
+	if (test_flag(CRLF) && __insert_cr(f) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Normalise, change the line length and align: what is done to
+ * every file bar those given --fold or --split-only.
+ */
+static int
+__format_mapped(mapped_file_t *f)
+{
+	if (__run_phase(f, PHASE_NORMALISE, normalise_text) == -1)
+		return -1;
+
+	if (test_flag(LENGTH))
+	{
+		if (__run_phase(f, PHASE_LENGTH, change_line_length) == -1)
+			return -1;
+	}
+
+	return __align_file(f);
+}
+
+/*
+ * Incremental formatting (--incremental). Beside the file we keep
+ * an index of the paragraphs that the last run wrote: where each
+ * one went and a hash of it. A paragraph runs up to and takes in
+ * the next run of two or more new lines, and formatting never
+ * looks across one of those, so on the next run any paragraph
+ * whose hash is in the index is output from last time and can be
+ * left where it is, and only the others need formatting again.
+ */
+#define INDEX_SUFFIX		".ftext-index"
+#define INDEX_VERSION		1
+
+/*
+ * Past this share of the file changed, it is quicker
+ * to just format the whole of it again.
+ */
+#define INCREMENTAL_MAX_DIRTY	0.5
+
+typedef struct para_t
+{
+	size_t		off;
+	size_t		len;
+	uint64_t	hash;
+} para_t;
+
+typedef struct para_index_t
+{
+	para_t	*paras;
+	size_t	nr;
+	size_t	max;
+} para_index_t;
+
+static uint64_t
+__hash_bytes(const char *p, size_t len)
+{
+	uint64_t	h = (0x9e3779b97f4a7c15ULL ^ len);
+	uint64_t	w;
+
+	for (; len >= 8; p += 8, len -= 8)
+	{
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= (h >> 32);
+	}
+
+	w = 0;
+	memcpy(&w, p, len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+
+	return (h ^ (h >> 29));
+}
+
+/*
+ * End of the paragraph of the SIZE bytes at P that starts at OFF:
+ * past the run of new lines after it. A line with only blanks (or
+ * a CR) on it is empty once normalised, so it is part of the run,
+ * and the next paragraph starts with text, just as it would in the
+ * file as a whole.
+ */
+#define is_blank_cr(c) ((c) == 0x20 || (c) == 0x09 || (c) == 0x0d)
+
+static size_t
+__para_end(const char *p, size_t size, size_t off)
+{
+	const char	*nl;
+	size_t			end;
+	size_t			i;
+
+	while ((nl = memchr(p + off, 0x0a, size - off)))
+	{
+		end = (size_t)(nl - p) + 1;
+
+		for (i = end; i < size && is_blank_cr(p[i]); ++i)
+			;
+
+		if (i < size && p[i] == 0x0a)
+		{
+			for (; i < size && (p[i] == 0x0a || is_blank_cr(p[i])); ++i)
+			{
+				if (p[i] == 0x0a)
+					end = (i + 1);
+			}
+
+			return (i == size ? size : end);
+		}
+
+		off = end;
+	}
+
+	return size;
+}
+
+static int
+__index_add(para_index_t *idx, size_t off, size_t len, uint64_t hash)
+{
+	para_t	*paras;
+
+	if (idx->nr == idx->max)
+	{
+		if (!(paras = realloc(idx->paras, (idx->max ? idx->max * 2 : 1024) * sizeof(para_t))))
+		{
+			fprintf(stderr, "__index_add: failed to allocate memory (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		idx->paras = paras;
+		idx->max = (idx->max ? idx->max * 2 : 1024);
+	}
+
+	idx->paras[idx->nr].off = off;
+	idx->paras[idx->nr].len = len;
+	idx->paras[idx->nr].hash = hash;
+	++idx->nr;
+
+	return 0;
+}
+
+/*
+ * Add the paragraphs of the LEN bytes at P, which are
+ * at offset BASE in the file, to the index.
+ */
+static int
+__index_text(para_index_t *idx, const char *p, size_t len, size_t base)
+{
+	size_t	off;
+	size_t	end;
+
+	for (off = 0; off < len; off = end)
+	{
+		end = __para_end(p, len, off);
+
+		if (__index_add(idx, base + off, end - off, __hash_bytes(p + off, end - off)) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The options that decide what the output looks like, so that
+ * an index (or journal) written with other options is not used.
+ */
+static void
+__options_signature(char *buf, size_t size, const char *kind, int version)
+{
+	snprintf(buf, size, "ftext-%s %d L%d o%x h%d\n", kind, version, MAX_LENGTH,
+		(unsigned int)(user_options & (LENGTH|ALIGNMENT_MASK)), HYPHEN_POLICY);
+}
+
+static int
+__cmp_hash(const void *a, const void *b)
+{
+	uint64_t	x = ((const para_t *)a)->hash;
+	uint64_t	y = ((const para_t *)b)->hash;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Load the index at PATH, sorted by hash. An index that is
+ * not there, or that was written with other options, loads
+ * as an empty one.
+ */
+static int
+__index_load(para_index_t *idx, char *path)
+{
+	FILE								*fp;
+	char								line[256];
+	char								sig[256];
+	unsigned long long	off;
+	unsigned long long	len;
+	unsigned long long	hash;
+
+	if (!(fp = fopen(path, "r")))
+	{
+		if (errno == ENOENT)
+			return 0;
+
+		fprintf(stderr, "__index_load: fopen error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	__options_signature(sig, sizeof(sig), "index", INDEX_VERSION);
+
+	if (!fgets(line, sizeof(line), fp) || strcmp(line, sig))
+	{
+		fclose(fp);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "%llu %llu %llx", &off, &len, &hash) != 3)
+			continue;
+
+		if (__index_add(idx, (size_t)off, (size_t)len, (uint64_t)hash) < 0)
+		{
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	fclose(fp);
+
+	if (idx->nr)
+		qsort(idx->paras, idx->nr, sizeof(para_t), __cmp_hash);
+
+	return 0;
+}
+
+/*
+ * Write the index to a new file and then move it over the
+ * old one, so that a run that dies part way through never
+ * leaves an index that doesn't match the file.
+ */
+static int
+__index_save(para_index_t *idx, char *path)
+{
+	FILE		*fp;
+	char		tmp[PATH_MAX];
+	char		sig[256];
+	size_t	i;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+	{
+		fprintf(stderr, "__index_save: path length exceeds PATH_MAX\n");
+		return -1;
+	}
+
+	if (!(fp = fopen(tmp, "w")))
+	{
+		fprintf(stderr, "__index_save: fopen error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	__options_signature(sig, sizeof(sig), "index", INDEX_VERSION);
+	fputs(sig, fp);
+
+	for (i = 0; i < idx->nr; ++i)
+	{
+		fprintf(fp, "%llu %llu %016llx\n", (unsigned long long)idx->paras[i].off,
+			(unsigned long long)idx->paras[i].len, (unsigned long long)idx->paras[i].hash);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0)
+	{
+		fprintf(stderr, "__index_save: failed to write %s (%s)\n", path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Format the LEN bytes at P on their own, in a temporary file
+ * beside NEAR, and hand back the result in *OUT (to be freed).
+ */
+static int
+__format_region(const char *p, size_t len, char *near, char **out, size_t *out_len)
+{
+	mapped_file_t	f;
+	size_t				i;
+	int						fd;
+	int						ret = -1;
+
+	clear_struct(&f);
+	*out = NULL;
+
+	if (snprintf(f.filename, PATH_MAX, "%s.XXXXXX", near) >= PATH_MAX)
+	{
+		fprintf(stderr, "__format_region: path length exceeds PATH_MAX\n");
+		return -1;
+	}
+
+	if ((fd = mkstemp(f.filename)) < 0)
+	{
+		fprintf(stderr, "__format_region: mkstemp error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	if (__write_all(fd, (char *)p, len) < 0)
+	{
+		close(fd);
+		unlink(f.filename);
+		return -1;
+	}
+
+	close(fd);
+
+	if (!(map_file(&f)))
+	{
+		unlink(f.filename);
+		return -1;
+	}
+
+	unlink(f.filename);
+
+	/*
+	 * Not as phases of their own: they are all
+	 * part of the one splicing the file together.
+	 */
+	if (normalise_text(&f) < 0 || change_line_length(&f) < 0)
+		goto out;
+
+	for (i = 0; i < NR_ALIGNMENTS; ++i)
+	{
+		if (test_flag(alignments[i].flag) && alignments[i].formatter(&f) < 0)
+			goto out;
+	}
+
+	*out_len = f.current_file_size;
+
+	if (!(*out = malloc(*out_len ? *out_len : 1)))
+	{
+		fprintf(stderr, "__format_region: failed to allocate memory (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	memcpy(*out, f.startp, *out_len);
+	ret = 0;
+
+	out:
+	unmap_file(&f);
+	return ret;
+}
+
+/*
+ * Go through the paragraphs of the file in order, passing those
+ * that are in OLD through where they are and swapping the rest
+ * for their formatted selves, and index the result in NEW. The
+ * sink moves nothing until the first paragraph that changes size,
+ * and each byte after it at most once.
+ */
+static int
+__splice_paragraphs(mapped_file_t *f, para_index_t *old, para_index_t *new)
+{
+	sink_t			s;
+	para_t			key;
+	const char	*in;
+	char				*out;
+	size_t			out_len;
+	size_t			size = f->current_file_size;
+	size_t			off;
+	size_t			end;
+
+	sink_init(&s, f);
+
+	for (off = 0; off < size; off = end)
+	{
+		in = sink_input(&s);
+		end = __para_end(in, size, off);
+		key.hash = __hash_bytes(in + off, end - off);
+
+		if (bsearch(&key, old->paras, old->nr, sizeof(para_t), __cmp_hash))
+		{
+			if (__index_add(new, s.wr, end - off, key.hash) < 0)
+				return -1;
+
+			sink_copy(&s, end - off);
+		}
+		else
+		{
+			if (__format_region(in + off, end - off, f->filename, &out, &out_len) < 0)
+				return -1;
+
+			if (__index_text(new, out, out_len, s.wr) < 0)
+			{
+				free(out);
+				return -1;
+			}
+
+			sink_skip(&s, end - off);
+
+			if (sink_put(&s, out, out_len) < 0)
+			{
+				free(out);
+				return -1;
+			}
+
+			free(out);
+		}
+
+		progress_update(end, 0);
+	}
+
+	return sink_finish(&s);
+}
+
+/*
+ * Format the file given --incremental, from the index of the last
+ * run if there is one that fits, or else in full as usual, and
+ * then leave an index of the result for next time.
+ */
+static int
+format_incremental(mapped_file_t *f)
+{
+	para_index_t	old;
+	para_index_t	new;
+	para_t				key;
+	char					path[PATH_MAX];
+	const char		*p = (const char *)f->startp;
+	size_t				size = f->current_file_size;
+	size_t				dirty = 0;
+	size_t				off;
+	size_t				end;
+	int						ret = -1;
+
+	clear_struct(&old);
+	clear_struct(&new);
+
+	if (snprintf(path, sizeof(path), "%s" INDEX_SUFFIX, f->filename) >= (int)sizeof(path))
+	{
+		fprintf(stderr, "format_incremental: path length exceeds PATH_MAX\n");
+		return -1;
+	}
+
+	if (__index_load(&old, path) < 0)
+		return -1;
+
+	for (off = 0; old.nr && off < size; off = end)
+	{
+		end = __para_end(p, size, off);
+		key.hash = __hash_bytes(p + off, end - off);
+
+		if (!bsearch(&key, old.paras, old.nr, sizeof(para_t), __cmp_hash))
+			dirty += (end - off);
+	}
+
+	if (!old.nr || dirty > (size * INCREMENTAL_MAX_DIRTY))
+	{
+		if (__format_mapped(f) == -1)
+			goto out;
+
+		if (__index_text(&new, (const char *)f->startp, f->current_file_size, 0) < 0)
+			goto out;
+	}
+	else
+	if (dirty)
+	{
+		begin_phase(PHASE_LENGTH, size);
+		ret = __splice_paragraphs(f, &old, &new);
+		end_phase(ret);
+
+		if (ret < 0)
+			goto out;
+	}
+	else
+	{
+		ret = 0;
+		goto out;
+	}
+
+	ret = __index_save(&new, path);
+
+	out:
+	free(old.paras);
+	free(new.paras);
+
+	return ret;
+}
+
+/*
+ * Load the journal for --resume, which has to be there, to have
+ * been written with the same options and to fit the file.
+ */
+static int
+__journal_load(journal_t *jr, mapped_file_t *f)
+{
+	FILE	*fp;
+	char	line[512];
+	int		n;
+
+	if (!(fp = fopen(jr->path, "r")))
+	{
+		if (errno == ENOENT)
+			fprintf(stderr, "__journal_load: %s has no journal to resume from\n", f->filename);
+		else
+			fprintf(stderr, "__journal_load: fopen error (%s)\n", strerror(errno));
+
+		return -1;
+	}
+
+	if (!fgets(line, sizeof(line), fp) || strcmp(line, jr->sig))
+	{
+		fprintf(stderr, "__journal_load: %s was written with other options\n", jr->path);
+		fclose(fp);
+		return -1;
+	}
+
+	n = (fgets(line, sizeof(line), fp) ? sscanf(line,
+		"phase=%d done=%d width=%zu in=%zu rd=%zu wr=%zu gap=%zu lines=%zu grow=%zu moved=%zu",
+		&jr->phase, &jr->done, &jr->width, &jr->in_size, &jr->rd, &jr->wr, &jr->gap,
+		&jr->lines, &jr->grow, &jr->moved) : 0);
+
+	fclose(fp);
+
+	/*
+	 * Once the phase is done the file may already have been cut
+	 * down to its output.
+	 */
+	if (n != 10 || jr->rd > jr->in_size || jr->wr > (jr->rd + jr->gap)
+	|| (jr->done ? jr->wr : (jr->in_size + jr->gap + jr->grow)) > f->current_file_size)
+	{
+		fprintf(stderr, "__journal_load: %s does not fit the file\n", jr->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Where to end the lot of input from OFF that the normaliser takes
+ * in one go: at the first break after BLOCK bytes that it never
+ * looks across, which is the end of a paragraph, or a new line
+ * between two letters or digits.
+ */
+static size_t
+__normalise_cut(const char *p, size_t size, size_t off, size_t block)
+{
+	const char	*nl;
+	size_t			i;
+
+	if ((size - off) <= block)
+		return size;
+
+	for (off += block; (nl = memchr(p + off, 0x0a, size - off)); off = i + 1)
+	{
+		i = (size_t)(nl - p);
+
+		if ((i + 1) < size && p[i + 1] == 0x0a)
+			return __para_end(p, size, i);
+
+		if ((i + 1) < size && isalnum((unsigned char)p[i - 1]) && isalnum((unsigned char)p[i + 1]))
+			return (i + 1);
+	}
+
+	return size;
+}
+
+/*
+ * The normaliser for a run with checkpoints, which has to go through
+ * the sink: it normalises the input a lot at a time in a buffer of
+ * its own, each lot ending where the output does not depend on what
+ * comes after.
+ */
+static int
+__normalise_sink(sink_t *s)
+{
+	const char	*in;
+	char				*buf = NULL;
+	size_t			size = s->in_size;
+	size_t			max = 0;
+	size_t			end;
+	size_t			len;
+	size_t			n;
+
+	while (s->rd < size)
+	{
+		sink_mark(s, 0);
+
+		in = sink_input(s);
+		end = __normalise_cut(in, size, s->rd, NORMALISE_BLOCK);
+		len = (end - s->rd);
+
+		if (len > max)
+		{
+			free(buf);
+
+			if (!(buf = malloc(len)))
+			{
+				fprintf(stderr, "__normalise_sink: failed to allocate memory (%s)\n", strerror(errno));
+				return -1;
+			}
+
+			max = len;
+		}
+
+		memcpy(buf, in + s->rd, len);
+
+		if (__normalise_buf(buf, len, s->rd, &n) < 0)
+			goto fail;
+
+		sink_skip(s, len);
+
+		if (sink_put(s, buf, n) < 0)
+			goto fail;
+	}
+
+	free(buf);
+	return sink_finish(s);
+
+	fail:
+	free(buf);
+	return -1;
+}
+
+/*
+ * Run PHASE over the file with a journal, from the state in JR
+ * if it was loaded part way through the phase.
+ */
+static int
+__run_checkpointed(mapped_file_t *f, journal_t *jr, int phase)
+{
+	wrap_state_t	st;
+	int						ret = -1;
+
+	sink_init(&st.s, f);
+
+	if (!jr->in_size)
+	{
+		jr->phase = phase;
+		jr->done = 0;
+		jr->width = 0;
+
+		if (phase == PHASE_LENGTH)
+			jr->width = (size_t)MAX_LENGTH;
+		else
+		if (phase == PHASE_JUSTIFY)
+			jr->width = (size_t)__align_width(f);
+	}
+
+	begin_phase(phase, f->current_file_size);
+
+	if (sink_attach(&st.s, jr) < 0)
+		goto out;
+
+	switch(phase)
+	{
+		case(PHASE_NORMALISE):
+		ret = __normalise_sink(&st.s);
+		break;
+		case(PHASE_LENGTH):
+		if (__wrap_begin(&st, jr->width) < 0)
+			break;
+
+		if (__wrap_step(&st, st.s.in_size, (int)jr->width) < 0)
+		{
+			free(st.w.sp);
+			break;
+		}
+
+		ret = __wrap_finish(&st);
+		break;
+		case(PHASE_JUSTIFY):
+		ret = __justify_step(&st.s, (int)jr->width);
+		break;
+	}
+
+	out:
+	acct_output(f->current_file_size);
+	end_phase(ret);
+	return ret;
+}
+
+/*
+ * Format the file with checkpoints (--checkpoint), or carry on from
+ * the last one (--resume): normalise, change the line length and
+ * justify, each in one pass through a sink with a journal, which is
+ * removed once the last of them is done.
+ */
+static int
+format_checkpointed(mapped_file_t *f)
+{
+	journal_t	jr;
+	int				phases[3];
+	int				nr = 0;
+	int				resuming = test_flag(RESUME);
+	int				i;
+
+	clear_struct(&jr);
+
+	if (snprintf(jr.path, sizeof(jr.path), "%s" JOURNAL_SUFFIX, f->filename) >= (int)sizeof(jr.path))
+	{
+		fprintf(stderr, "format_checkpointed: path length exceeds PATH_MAX\n");
+		return -1;
+	}
+
+	__options_signature(jr.sig, sizeof(jr.sig), "journal", JOURNAL_VERSION);
+	jr.every = CHECKPOINT_EVERY;
+
+	if (resuming)
+	{
+		if (__journal_load(&jr, f) < 0)
+			return -1;
+	}
+	else
+	if (access(jr.path, F_OK) == 0)
+	{
+		fprintf(stderr, "format_checkpointed: %s was left part way through by an earlier run (use --resume)\n", f->filename);
+		return -1;
+	}
+
+	phases[nr++] = PHASE_NORMALISE;
+
+	if (test_flag(LENGTH))
+		phases[nr++] = PHASE_LENGTH;
+
+	if (test_flag(JUSTIFY))
+		phases[nr++] = PHASE_JUSTIFY;
+
+	for (i = 0; i < nr; ++i)
+	{
+		if (resuming)
+		{
+			if (phases[i] != jr.phase)
+				continue;
+
+			resuming = 0;
+
+			/*
+			 * Killed between the end of the phase
+			 * and cutting the file down.
+			 */
+			if (jr.done)
+			{
+				if (__truncate_file(f, jr.wr) < 0)
+					return -1;
+
+				jr.in_size = 0;
+				continue;
+			}
+		}
+
+		if (__run_checkpointed(f, &jr, phases[i]) < 0)
+			return -1;
+
+		jr.in_size = 0;
+	}
+
+	if (resuming)
+	{
+		fprintf(stderr, "format_checkpointed: %s does not fit the file\n", jr.path);
+		return -1;
+	}
+
+	if (unlink(jr.path) < 0)
+	{
+		fprintf(stderr, "format_checkpointed: unlink error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * --dry-run and --reserve. What each step does to a file is worked
+ * out by running it over a piece of the file at a time in a file of
+ * their own in memory, so the file itself is only read. The pieces
+ * end where none of the steps looks across: at a paragraph break if
+ * the text is wrapped or justified, or else at the end of a line
+ * (one that the normaliser won't join to the next, if it runs). So
+ * they come out just as they would in the file as a whole, and only
+ * a paragraph that is wrapped or justified has to be taken whole.
+ */
+#define PLAN_BLOCK	(1024 * 1024)
+#define MAX_STAGES	8
+
+#define PLAN_CUT_LINE				0
+#define PLAN_CUT_NORMALISE	1
+#define PLAN_CUT_PARAGRAPH	2
+
+typedef struct stage_t
+{
+	const char	*name;
+	int					phase;
+	int					(*formatter)(mapped_file_t *);
+	int					sized;				/* doesn't go through a sink */
+	size_t			bytes_out;
+	size_t			inserted;
+	size_t			deleted;
+} stage_t;
+
+typedef struct plan_t
+{
+	size_t	bytes_in;
+	size_t	peak;						/* the largest the file gets */
+	int			width;					/* the width to align to without -L */
+	int			cut;						/* PLAN_CUT_* */
+	int			nr_stages;
+	stage_t	stages[MAX_STAGES];
+	size_t	growth[NR_PHASE_TYPES];
+} plan_t;
+
+static void
+__plan_stage(plan_t *plan, const char *name, int phase, int (*formatter)(mapped_file_t *), int sized)
+{
+	stage_t	*st = &plan->stages[plan->nr_stages++];
+
+	st->name = name;
+	st->phase = phase;
+	st->formatter = formatter;
+	st->sized = sized;
+}
+
+/*
+ * The steps format_file() takes, in order.
+ */
+static void
+__plan_stages(plan_t *plan)
+{
+	size_t	i;
+
+	plan->cut = PLAN_CUT_LINE;
+
+	if (test_flag(FOLD))
+	{
+		__plan_stage(plan, "fold", PHASE_FOLD, fold_text, 1);
+		return;
+	}
+
+	if (test_flag(SPLIT_ONLY))
+	{
+		__plan_stage(plan, "length", PHASE_LENGTH, split_long_lines, 0);
+		return;
+	}
+
+	__plan_stage(plan, "normalise", PHASE_NORMALISE, normalise_text, 1);
+	plan->cut = PLAN_CUT_NORMALISE;
+
+	if (test_flag(LENGTH))
+		__plan_stage(plan, "length", PHASE_LENGTH, change_line_length, 0);
+
+	if (test_flag(LENGTH) || test_flag(JUSTIFY))
+		plan->cut = PLAN_CUT_PARAGRAPH;
+
+	for (i = 0; i < NR_ALIGNMENTS; ++i)
+	{
+		if (test_flag(alignments[i].flag))
+			__plan_stage(plan, phase_names[alignments[i].phase], alignments[i].phase, alignments[i].formatter, 0);
+	}
+
+	if (test_flag(CRLF))
+		__plan_stage(plan, "crlf", PHASE_IDLE, __insert_cr, 1);
+}
+
+/*
+ * Put the LEN bytes at P in a file of their own in memory,
+ * mapped as F.
+ */
+static int
+__scratch_file(mapped_file_t *f, const char *p, size_t len)
+{
+	clear_struct(f);
+	strcpy(f->filename, "ftext-scratch");
+
+	if ((f->fd = memfd_create(f->filename, 0)) < 0)
+	{
+		fprintf(stderr, "__scratch_file: memfd_create error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	if (__write_all(f->fd, (char *)p, len) < 0 || !__map_fd(f, len))
+	{
+		close(f->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * End of the piece from OFF of the SIZE bytes at P, cut as CUT.
+ */
+static size_t
+__plan_piece_end(int cut, const char *p, size_t size, size_t off)
+{
+	const char	*nl;
+	size_t			end;
+
+	if (cut == PLAN_CUT_PARAGRAPH)
+	{
+		for (end = off; end < size && (end - off) < PLAN_BLOCK; )
+			end = __para_end(p, size, end);
+
+		return end;
+	}
+
+	if (cut == PLAN_CUT_NORMALISE)
+		return __normalise_cut(p, size, off, PLAN_BLOCK);
+
+	if ((size - off) <= PLAN_BLOCK)
+		return size;
+
+	if ((nl = memchr(p + off + PLAN_BLOCK, 0x0a, size - off - PLAN_BLOCK)))
+		return (size_t)(nl - p) + 1;
+
+	return size;
+}
+
+/*
+ * Let go of the pages of the input that are done with, so that
+ * reading a large file doesn't keep all of it resident.
+ */
+static void
+__plan_release(const char *p, size_t off, size_t end)
+{
+	uintptr_t	page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t	from = (((uintptr_t)(p + off) + page - 1) & ~(page - 1));
+	uintptr_t	to = ((uintptr_t)(p + end) & ~(page - 1));
+
+	if (to > from)
+		madvise((void *)from, to - from, MADV_DONTNEED);
+}
+
+/*
+ * Without -L, the width to align to is that of the longest line
+ * once the text has been normalised.
+ */
+static int
+__plan_width(const char *p, size_t size)
+{
+	mapped_file_t	f;
+	size_t				off;
+	size_t				end;
+	int						width = 0;
+	int						w;
+
+	for (off = 0; off < size; off = end)
+	{
+		end = __plan_piece_end(PLAN_CUT_NORMALISE, p, size, off);
+
+		if (__scratch_file(&f, p + off, end - off) < 0)
+			return -1;
+
+		if (normalise_text(&f) < 0)
+		{
+			unmap_file(&f);
+			return -1;
+		}
+
+		if ((w = __get_length_longest_line(&f)) > width)
+			width = w;
+
+		unmap_file(&f);
+		__plan_release(p, off, end);
+	}
+
+	return width;
+}
+
+/*
+ * Work out what formatting the SIZE bytes at P would do: the size
+ * of the text after each step, the bytes each inserts and deletes
+ * (a byte that is replaced counts as one of each), the largest the
+ * file gets, and what each phase adds. A step that doesn't go
+ * through a sink only inserts (or only deletes) bytes, apart from
+ * any it counts itself, so what it does is told by how its size
+ * changes.
+ */
+static int
+__plan_file(plan_t *plan, const char *p, size_t size)
+{
+	mapped_file_t	f;
+	stage_t				*st;
+	size_t				off;
+	size_t				end;
+	size_t				before;
+	size_t				inserted;
+	size_t				deleted;
+	size_t				in;
+	int						i;
+
+	clear_struct(plan);
+	plan->bytes_in = size;
+	__plan_stages(plan);
+
+	if (!test_flag(LENGTH) && (user_options & (JUSTIFY|RALIGN|CALIGN))
+	&& (plan->width = __plan_width(p, size)) < 0)
+		return -1;
+
+	for (off = 0; off < size; off = end)
+	{
+		end = __plan_piece_end(plan->cut, p, size, off);
+
+		if (__scratch_file(&f, p + off, end - off) < 0)
+			return -1;
+
+		f.width = plan->width;
+
+		for (i = 0; i < plan->nr_stages; ++i)
+		{
+			st = &plan->stages[i];
+			before = f.current_file_size;
+			inserted = INSERTED;
+			deleted = DELETED;
+
+			if (st->formatter(&f) < 0)
+			{
+				unmap_file(&f);
+				return -1;
+			}
+
+			st->bytes_out += f.current_file_size;
+			st->inserted += (INSERTED - inserted);
+			st->deleted += (DELETED - deleted);
+
+			if (!st->sized)
+				continue;
+
+			if (f.current_file_size > before)
+				st->inserted += (f.current_file_size - before);
+			else
+				st->deleted += (before - f.current_file_size);
+		}
+
+		unmap_file(&f);
+		__plan_release(p, off, end);
+	}
+
+	/*
+	 * Each step works in place, and none of them makes the
+	 * file any bigger on the way than it is at the end (with
+	 * --reserve, that goes for the sink too).
+	 */
+	plan->peak = size;
+
+	for (i = 0, in = size; i < plan->nr_stages; in = st->bytes_out, ++i)
+	{
+		st = &plan->stages[i];
+
+		if (st->bytes_out > plan->peak)
+			plan->peak = st->bytes_out;
+
+		if (st->bytes_out > in && st->phase != PHASE_IDLE)
+			plan->growth[st->phase] = (st->bytes_out - in);
+	}
+
+	return 0;
+}
+
+/*
+ * The scratch files are not the file being formatted, so what
+ * they cost is left out of its accounting.
+ */
+static int
+plan_file(plan_t *plan, const char *p, size_t size)
+{
+#ifdef ACCOUNTING
+	uint64_t	acct[NR_ACCT];
+	int				ret;
+
+	memcpy(acct, ACCT, sizeof(acct));
+	ret = __plan_file(plan, p, size);
+	memcpy(ACCT, acct, sizeof(acct));
+
+	return ret;
+#else
+	return __plan_file(plan, p, size);
+#endif
+}
 
-		++p;
+static void
+__print_plan(plan_t *plan, const char *name, int width)
+{
+	size_t	inserted = 0;
+	size_t	deleted = 0;
+	int			i;
+
+	for (i = 0; i < plan->nr_stages; ++i)
+	{
+		inserted += plan->stages[i].inserted;
+		deleted += plan->stages[i].deleted;
+	}
+
+	fputs("{\"file\":", stdout);
+	__json_string(stdout, name);
+
+	if (width)
+		fprintf(stdout, ",\"width\":%d", width);
+
+	fprintf(stdout, ",\"bytes_in\":%zu,\"bytes_out\":%zu,\"inserted\":%zu,\"deleted\":%zu,\"reserve_bytes\":%zu,\"steps\":[",
+		plan->bytes_in, (plan->nr_stages ? plan->stages[plan->nr_stages - 1].bytes_out : plan->bytes_in),
+		inserted, deleted, plan->peak);
+
+	for (i = 0; i < plan->nr_stages; ++i)
+	{
+		fprintf(stdout, "%s{\"step\":\"%s\",\"bytes_out\":%zu,\"inserted\":%zu,\"deleted\":%zu}", (i ? "," : ""),
+			plan->stages[i].name, plan->stages[i].bytes_out, plan->stages[i].inserted, plan->stages[i].deleted);
 	}
 
-	return lines;
+	fputs("]}\n", stdout);
+	fflush(stdout);
 }
 
 /*
- * Some formatting options require knowing the longest line
- * in the file in order to format the other lines accordingly.
- * E.g., justifying the text means adding enough spaces to
- * all lines shorter than the longest line; centre-aligning
- * means knowing the character offset of the centre of longest
- * line.
+ * --dry-run: say what formatting the file NAME would do, as a line
+ * of JSON (one for each line length, with -o), and change nothing.
  */
 static int
-__get_length_longest_line(mapped_file_t *f)
+dry_run_file(char *name)
 {
-	assert(f);
+	plan_t			plan;
+	const char	*p = NULL;
+	size_t			size;
+	int					max_length = MAX_LENGTH;
+	int					ret = 0;
+	int					i;
+
+	if (map_input(name, &p, &size) < 0)
+		return -1;
 
-	int		max_length = 0;
-	int		char_cnt = 0;
-	char	*p = (char *)f->startp;
-	char	*endp = (char *)f->endp;
-	char	*line_start = NULL;
-	char	*line_end = NULL;
-	size_t	len = f->map_size;
+	for (i = 0; i < (OUTPUT_TEMPLATE ? NR_WIDTHS : 1); ++i)
+	{
+		if (OUTPUT_TEMPLATE)
+			MAX_LENGTH = WIDTHS[i];
 
-	while (p < endp)
+		if (plan_file(&plan, p, size) < 0)
+		{
+			ret = -1;
+			break;
+		}
+
+		__print_plan(&plan, name, (OUTPUT_TEMPLATE ? MAX_LENGTH : 0));
+	}
+
+	MAX_LENGTH = max_length;
+
+	if (p)
+		munmap((void *)p, size);
+
+	return ret;
+}
+
+/*
+ * --reserve: allocate all the space that formatting the file will
+ * need before starting, so that running out of it can't leave the
+ * file half done, and tell the sink how much each phase adds.
+ */
+static int
+__reserve(mapped_file_t *f, plan_t *plan)
+{
+	if (plan_file(plan, (const char *)f->startp, f->current_file_size) < 0)
+		return -1;
+
+	if (!plan->peak)
+		return 0;
+
+	if (fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)plan->peak) < 0)
 	{
-		char_cnt = 0;
-		line_start = p;
+		fprintf(stderr, "__reserve: cannot reserve %zu bytes for %s (%s)\n",
+			plan->peak, f->filename, strerror(errno));
+		return -1;
+	}
 
-		while (*p == 0x20 || *p == 0x09)
-			++p;
+	f->reserved = plan->peak;
+	f->growth = plan->growth;
 
-		len -= (p - line_start);
+	return 0;
+}
 
-		line_start = p;
-	
-		line_end = memchr(line_start, 0x0a, len);
+/*
+ * Give back what is left of the space reserved past the end.
+ */
+static void
+__unreserve(mapped_file_t *f)
+{
+	size_t	size = f->current_file_size;
 
-		if (!line_end)
-			break;
+	if (ftruncate(f->fd, (off_t)size) < 0)
+		fprintf(stderr, "__unreserve: ftruncate error (%s)\n", strerror(errno));
 
-		while (p < line_end)
-		{
-			if (*p == 0x20)
-			{
-				++p;
-				++char_cnt;
+	if (f->reserved > size)
+		fallocate(f->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)size, (off_t)(f->reserved - size));
 
-				while (*p == 0x20)
-					++p;
+	f->reserved = 0;
+}
 
-				continue;
-			}
-			else
-			if (*p == 0x0a)
-			{
-				break;
-			}
+/**
+ * Carry out all of the operations the user asked
+ * for on the file of job number INDEX.
+ */
+static int
+format_file(int index)
+{
+	job_t					*job = &JOBS[index];
+	mapped_file_t	*f = &job->file;
+	plan_t				plan;
+	size_t				out_bytes = 0;
+	int						ret = -1;
 
-			++p;
-			++char_cnt;
-		}
+	begin_file(index, job->size);
+
+	clear_struct(f);
+	strcpy(f->filename, job->name);
 
-		if (char_cnt > max_length)
-			max_length = char_cnt;
+	if (!(map_file(f)))
+		goto out;
 
-		while (*p == 0x0a && p < endp)
-			++p;
+	if (test_flag(RESERVE) && __reserve(f, &plan) < 0)
+		goto out;
 
-		len -= (p - line_start);
+	/*
+	 * Folding is for text that has to be kept byte for
+	 * byte, such as logs, so it isn't normalised first.
+	 */
+	if (test_flag(FOLD))
+	{
+		if (__run_phase(f, PHASE_FOLD, fold_text) == -1)
+			goto out;
+
+		ret = 0;
+		out_bytes = f->current_file_size;
+		goto out;
+	}
+
+	/*
+	 * Likewise for splitting the long lines only.
+	 */
+	if (test_flag(SPLIT_ONLY))
+	{
+		if (__run_phase(f, PHASE_LENGTH, split_long_lines) == -1)
+			goto out;
+
+		ret = 0;
+		out_bytes = f->current_file_size;
+		goto out;
+	}
+
+	if (test_flag(CHECKPOINT))
+	{
+		if (format_checkpointed(f) == -1)
+			goto out;
+	}
+	else
+	if (test_flag(INCREMENTAL))
+	{
+		if (format_incremental(f) == -1)
+			goto out;
 	}
+	else
+	if (__format_mapped(f) == -1)
+		goto out;
+
+	ret = 0;
+	out_bytes = f->current_file_size;
+
+	out:
+	if (f->reserved)
+		__unreserve(f);
+
+	if (f->startp && f->startp != MAP_FAILED)
+		unmap_file(f);
 
-	return max_length;
+	end_file(ret, out_bytes);
+	return ret;
 }
 
 /*
- * Strip file of 0x0d (\r) characters.
+ * The name of the output for line length WIDTH: the -o
+ * template with each %w in it replaced by the width.
  */
-static void
-__remove_cr(mapped_file_t *f)
+static int
+__output_name(char *buf, int width)
 {
-	char	*prev = NULL;
-	char	*p = NULL;
-	char	*startp = (char *)f->startp;
-	char	*endp = (char *)f->endp;
-	size_t len = f->map_size;
+	char		*t;
+	size_t	n = 0;
+	int			k;
 
-	if (!(p = memchr(startp, 0x0d, len)))
-		return;
+	for (t = OUTPUT_TEMPLATE; *t; ++t)
+	{
+		if (t[0] == 0x25 && t[1] == 0x77)
+		{
+			k = snprintf(buf + n, PATH_MAX - n, "%d", width);
+			if (k < 0 || (size_t)k >= (PATH_MAX - n))
+				goto too_long;
+
+			n += k;
+			++t;
+			continue;
+		}
 
-	len -= (p - startp);
+		if ((n + 1) >= PATH_MAX)
+			goto too_long;
 
-	while (p < endp)
+		buf[n++] = *t;
+	}
+
+	buf[n] = 0;
+	return 0;
+
+	too_long:
+	fprintf(stderr, "__output_name: path length exceeds PATH_MAX\n");
+	return -1;
+}
+
+/*
+ * Copy the file SRC to a new temporary file beside NEAR,
+ * and put the name of the copy in TMP (PATH_MAX bytes).
+ */
+static int
+__copy_to_temp(char *src, char *near, char *tmp)
+{
+	struct stat	statb;
+	void				*p = MAP_FAILED;
+	int					in = -1;
+	int					out = -1;
+
+	if (snprintf(tmp, PATH_MAX, "%s.XXXXXX", near) >= PATH_MAX)
+	{
+		fprintf(stderr, "__copy_to_temp: path length exceeds PATH_MAX\n");
+		return -1;
+	}
+
+	if ((in = open(src, O_RDONLY)) < 0 || fstat(in, &statb) < 0)
+	{
+		fprintf(stderr, "__copy_to_temp: failed to open %s (%s)\n", src, strerror(errno));
+		goto fail;
+	}
+
+	if ((out = mkstemp(tmp)) < 0)
 	{
-		prev = p;
+		fprintf(stderr, "__copy_to_temp: mkstemp error (%s)\n", strerror(errno));
+		goto fail;
+	}
 
-		__collapse_file(f, (off_t)(p - startp), (size_t)1);
-		--len;
+	if (statb.st_size)
+	{
+		if ((p = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, in, 0)) == MAP_FAILED)
+		{
+			fprintf(stderr, "__copy_to_temp: mmap error (%s)\n", strerror(errno));
+			goto fail;
+		}
 
-		if (!(p = memchr(prev, 0x0d, len)))
-			break;
+		if (__write_all(out, (char *)p, statb.st_size) < 0)
+			goto fail;
 
-		len -= (p - prev);
+		munmap(p, statb.st_size);
 	}
 
-	return;
+	close(in);
+	close(out);
+
+	return 0;
+
+	fail:
+	if (p != MAP_FAILED)
+		munmap(p, statb.st_size);
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+	{
+		close(out);
+		unlink(tmp);
+	}
+
+	return -1;
 }
 
+/*
+ * How far the wraps in format_widths() go before the
+ * next one takes its turn over the input.
+ */
+#define WIDTHS_BLOCK	(32 * 1024)
+
 /**
- * Remove whitespace at the start and end of a line
- * (not including new lines! -- 0x20 / 0x09).
+ * As format_file(), but for each of the line lengths given with
+ * -L, writing each result to its own file and leaving the file
+ * of job number INDEX as it was. The text is normalised once, in
+ * a temporary copy, and then the wraps to each width take turns
+ * over it a block at a time, so that it only has to come in from
+ * memory once. The alignment is done afterwards on each output.
  */
-static void
-__remove_extra_whitespace(mapped_file_t *f)
+static int
+format_widths(int index)
 {
-	char	*p = (char *)f->startp;
-	char	*startp = (char *)f->startp;
-	char	*endp = (char *)f->endp;
-	char	*save_p = NULL;
-	size_t	range;
+	job_t					*job = &JOBS[index];
+	mapped_file_t	*f = &job->file;
+	mapped_file_t	out;
+	wrap_state_t	*st = NULL;
+	char					*bufs = NULL;
+	char					name[PATH_MAX];
+	int						fds[MAX_WIDTHS];
+	size_t				out_bytes = 0;
+	size_t				upto;
+	int						begun = 0;
+	int						i;
+	int						ret = -1;
+
+	begin_file(index, job->size);
 
-	while (p < endp)
+	clear_struct(f);
+	for (i = 0; i < NR_WIDTHS; ++i)
+		fds[i] = -1;
+
+	if (__output_name(name, WIDTHS[0]) < 0 || __copy_to_temp(job->name, name, f->filename) < 0)
+		goto out;
+
+	if (!(map_file(f)))
+	{
+		unlink(f->filename);
+		goto out;
+	}
+
+	/*
+	 * The copy lives on only as long as the mapping does.
+	 */
+	unlink(f->filename);
+
+	if (__run_phase(f, PHASE_NORMALISE, normalise_text) == -1)
+		goto out;
+
+	if (!(st = calloc(NR_WIDTHS, sizeof(wrap_state_t)))
+	|| !(bufs = malloc(NR_WIDTHS * SINK_BUF_SIZE)))
+	{
+		fprintf(stderr, "format_widths: failed to allocate memory (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	for (begun = 0; begun < NR_WIDTHS; ++begun)
 	{
-		save_p = p;
+		if (__output_name(name, WIDTHS[begun]) < 0)
+			goto out;
 
-		if (*p == 0x20 || *p == 0x09)
+		if ((fds[begun] = open(name, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0)
 		{
-			while (*p == 0x20 || *p == 0x09)
-				++p;
+			fprintf(stderr, "format_widths: failed to open %s (%s)\n", name, strerror(errno));
+			goto out;
+		}
+
+		sink_init_fd(&st[begun].s, f, fds[begun], bufs + (begun * SINK_BUF_SIZE));
+
+		if (__wrap_begin(&st[begun], (size_t)WIDTHS[begun]) < 0)
+			goto out;
+	}
 
-			range = (p - save_p);
+	begin_phase(PHASE_LENGTH, f->current_file_size);
 
-			if (range)
+	for (upto = 0; upto < f->current_file_size; )
+	{
+		upto += WIDTHS_BLOCK;
+
+		for (i = 0; i < NR_WIDTHS; ++i)
+		{
+			if (__wrap_step(&st[i], upto, WIDTHS[i]) < 0)
 			{
-				__collapse_file(f, (off_t)(save_p - startp), range);
-				endp -= range;
-				p = save_p;
-				range = 0;
+				end_phase(-1);
+				goto out;
 			}
 		}
+	}
 
-		p = memchr(save_p, 0x0a, (endp - save_p));
+	for (ret = 0; begun > 0; --begun)
+	{
+		if (__wrap_finish(&st[begun - 1]) < 0)
+			ret = -1;
+	}
 
-		if (!p)
-		{
-			p = endp - 1;
-			if (*p == 0x20 || *p == 0x09)
-			{
-				save_p = endp;
-				while (*p == 0x20 || *p == 0x09)
-					--p;
+	end_phase(ret);
 
-				++p;
+	if (ret < 0)
+		goto out;
 
-				range = (save_p - p);
+	ret = -1;
+	for (i = 0; i < NR_WIDTHS; ++i)
+	{
+		close(fds[i]);
+		fds[i] = -1;
+	}
 
-				if (range)
-				{
-					__collapse_file(f, (off_t)(p - startp), range);
-					endp -= range;
-					range = 0;
-				}
-			}
+	unmap_file(f);
 
-			break;
-		}
+	/*
+	 * The alignments take the width from MAX_LENGTH, which is
+	 * safe to change here as -o only takes the one file.
+	 */
+	for (i = 0; i < NR_WIDTHS; ++i)
+	{
+		clear_struct(&out);
+		if (__output_name(out.filename, WIDTHS[i]) < 0 || !(map_file(&out)))
+			goto out;
 
-		save_p = p;
-		--p;
+		MAX_LENGTH = WIDTHS[i];
 
-		if (*p == 0x20 || *p == 0x09)
+		if (__align_file(&out) == -1)
 		{
-			while (*p == 0x20 || *p == 0x09)
-				--p;
+			unmap_file(&out);
+			goto out;
+		}
 
-			++p;
+		out_bytes += out.current_file_size;
+		unmap_file(&out);
+	}
 
-			range = (save_p - p);
+	ret = 0;
 
-			if (range)
-			{
-				__collapse_file(f, (off_t)(p - startp), range);
-				endp -= range;
-				range = 0;
-				++p;
-			}
-		}
+	out:
+	while (begun > 0)
+		free(st[--begun].w.sp);
 
-		if (*save_p == 0x0a)
-			p = save_p + 1;
+	for (i = 0; i < NR_WIDTHS; ++i)
+	{
+		if (fds[i] >= 0)
+			close(fds[i]);
 	}
 
-	return;
+	if (f->startp && f->startp != MAP_FAILED)
+		unmap_file(f);
+
+	free(st);
+	free(bufs);
+
+	end_file(ret, out_bytes);
+	return ret;
 }
 
-static void
-__unjustify_text(mapped_file_t *f)
+/**
+ * Worker threads take the next file that nobody has
+ * started on yet until there are none left.
+ * @arg - the index of the worker's progress slot.
+ */
+static void *
+__worker(void *arg)
 {
-	char	*p = (char *)f->startp;
-	char	*startp = (char *)f->startp;
-	char	*endp = (char *)f->endp;
-	char	*save_p = NULL;
-	size_t	range;
+	int		job;
+
+	PROGRESS = &progress_slots[(intptr_t)arg];
+	perf_open();
+
+	while ((job = __atomic_fetch_add(&NEXT_JOB, 1, __ATOMIC_RELAXED)) < NR_JOBS)
+		JOBS[job].status = (OUTPUT_TEMPLATE ? format_widths(job) : format_file(job));
+
+	perf_close();
+	return NULL;
+}
+
+/*
+ * Generated corpora, for benchmarking (--bench) and for
+ * comparing against other tools (--gen-corpus).
+ *
+ * The text is made up of random words in paragraphs of ragged
+ * lines, with the things that the normaliser has to deal with
+ * mixed in: runs of spaces, CRLF line endings, words broken
+ * over lines with a hyphen and the odd token that is longer
+ * than any sensible line.
+ */
+static uint64_t
+__rand(uint64_t *state)
+{
+	uint64_t	x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return (*state = x);
+}
+
+static char *
+__gen_text(size_t size, uint64_t seed)
+{
+	uint64_t	state = seed | 1;
+	char	*text;
+	char	*p;
+	char	*endp;
+	int		col = 0;
+	int		line_len;
+	int		lines = 0;
+	int		para_len;
+	int		len;
+	int		i;
+
+	if (!(text = malloc(size)))
+		return NULL;
+
+	p = text;
+	endp = (text + size);
+	line_len = 50 + (int)(__rand(&state) % 40);
+	para_len = 3 + (int)(__rand(&state) % 10);
 
 	while (p < endp)
 	{
-		save_p = p;
+		if (!(__rand(&state) % 500))
+			len = 20 + (int)(__rand(&state) % 120);
+		else
+			len = 1 + (int)(__rand(&state) % 10);
 
-		p = memchr(save_p, 0x20, (endp - save_p));
+		for (i = 0; i < len && p < endp; ++i)
+			*p++ = (char)(0x61 + (__rand(&state) % 26));
 
-		if (!p)
-			break;
+		col += len;
 
-		++p;
-		save_p = p;
+		if (p < endp && !(__rand(&state) % 12))
+			*p++ = (__rand(&state) & 1) ? 0x2c : 0x2e;
 
-		while (*p == 0x20)
-			++p;
+		if (col < line_len)
+		{
+			switch(__rand(&state) % 20)
+			{
+				case 0:
+				len = 2 + (int)(__rand(&state) % 4);
+				break;
+				default:
+				len = 1;
+			}
+
+			for (i = 0; i < len && p < endp; ++i)
+				*p++ = 0x20;
+
+			col += len;
+			continue;
+		}
+
+		col = 0;
+		line_len = 50 + (int)(__rand(&state) % 40);
+
+		if (++lines >= para_len)
+		{
+			lines = 0;
+			para_len = 3 + (int)(__rand(&state) % 10);
 
-		range = (p - save_p);
+			for (i = 0; i < 2 && p < endp; ++i)
+				*p++ = 0x0a;
+
+			continue;
+		}
 
-		if (range)
+		switch(__rand(&state) % 20)
 		{
-			__collapse_file(f, (off_t)(save_p - startp), range);
-			endp -= range;
-			p = save_p;
-			range = 0;
+			case 0:
+			if (p < endp)
+				*p++ = 0x2d;
+			break;
+			case 1:
+			if (p < endp)
+				*p++ = 0x0d;
+			break;
+			case 2:
+			if (p < endp)
+				*p++ = 0x20;
+			break;
 		}
+
+		if (p < endp)
+			*p++ = 0x0a;
+	}
+
+	text[size-1] = 0x0a;
+	return text;
+}
+
+/**
+ * Parse a size such as 4096, 64K, 16M or 1G.
+ */
+static size_t
+__parse_size(char *str)
+{
+	char		*e;
+	double	size = strtod(str, &e);
+
+	switch(*e)
+	{
+		case 0x47:
+		case 0x67:
+			size *= 1024;
+			/* fall through */
+		case 0x4d:
+		case 0x6d:
+			size *= 1024;
+			/* fall through */
+		case 0x4b:
+		case 0x6b:
+			size *= 1024;
+			++e;
+			break;
+	}
+
+	if (e == str || *e || size < 1)
+		return 0;
+
+	return (size_t)size;
+}
+
+/**
+ * Write SIZE bytes of generated text to standard output.
+ */
+static int
+gen_corpus(char *arg)
+{
+	size_t	size;
+	char		*text;
+	int			ret;
+
+	if (!(size = __parse_size(arg)))
+	{
+		fprintf(stderr, "gen_corpus: invalid size (%s)\n", arg);
+		return -1;
+	}
+
+	if (!(text = __gen_text(size, 0x5eed)))
+	{
+		fprintf(stderr, "gen_corpus: failed to allocate memory (%s)\n", strerror(errno));
+		return -1;
 	}
 
-	return;
+	ret = __write_all(STDOUT_FILENO, text, size);
+	free(text);
+
+	return ret;
 }
 
-static void
-__normalise_file(mapped_file_t *f)
+/*
+ * Thread scaling benchmark (--bench). Every operation is run
+ * on each size of corpus with 1, 2, 4 ... N workers, each run
+ * formatting N copies of the corpus so that the work is the
+ * same whatever the number of workers. The best of BENCH_REPS
+ * runs is kept. Results can be saved as a baseline and later
+ * runs compared against it.
+ */
+#define BENCH_REPS				5
+#define BENCH_TOLERANCE		0.10
+#define BENCH_SIZES				"16K,64K,256K"
+#define BENCH_MAX_SIZES		16
+#define BENCH_MAX_RESULTS	1024
+
+static const struct
 {
-	char	*p = (char *)f->startp;
-	char	*startp = (char *)f->startp;
-	char	*endp = NULL;
-	char	*save_p = NULL;
+	const char	*name;
+	uint32_t		options;
+	int					length;
+} bench_ops[] =
+{
+	{ "L72", LENGTH, 72 },
+	{ "L72j", LENGTH|JUSTIFY, 72 },
+	{ "L73", LENGTH, 73 },
+	{ "L73j", LENGTH|JUSTIFY, 73 },
+	{ "u", UNJUSTIFY, 0 },
+	{ "L72r", LENGTH|RALIGN, 72 },
+	{ "L72c", LENGTH|CALIGN, 72 }
+};
+
+#define NR_BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+typedef struct bench_result_t
+{
+	char		op[32];
+	size_t	size;
+	int			threads;
+	double	seconds;
+	double	rate;				/* MB/s */
+	double	speedup;
+	double	efficiency;
+	int			regression;
+} bench_result_t;
+
+static char	*BENCH_SIZE_LIST = BENCH_SIZES;
+static char	*BENCH_JSON;			/* --bench-json */
+static char	*BENCH_BASELINE;	/* --bench-baseline */
 
-	__remove_cr(f);
-	__remove_extra_whitespace(f);
-	__unjustify_text(f);
+/**
+ * Time one run of the current options over all of the
+ * jobs with NR_WORKERS workers. The files are put back to
+ * how they were beforehand (which is not timed).
+ */
+static double
+__bench_run(char *text, size_t size)
+{
+	pthread_t	workers[MAX_WORKERS];
+	uint64_t	start;
+	int				fd;
+	int				i;
 
-	endp = (char *)f->endp;
-	
-	/*
-	 * Finish off by removing any -\n sequencies.
-	 */
-	while (p < endp)
+	for (i = 0; i < NR_JOBS; ++i)
 	{
-		save_p = p;
-
-		p = memchr(save_p, 0x2d, (endp - save_p));
-
-		if (!p)
-			break;
+		/*
+		 * Truncating a file that has just had its pages dirtied
+		 * through a shared mapping can take much longer than
+		 * starting again with a new one.
+		 */
+		unlink(JOBS[i].name);
 
-		if (*(p+1) == 0x0a)
+		if ((fd = open(JOBS[i].name, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR)) < 0)
 		{
-			__collapse_file(f, (off_t)(p - startp), (size_t)2);
-			endp -= 2;
-
-			while (*p != 0x20 && p > startp)
-				--p;
-
-			if (*p == 0x20)
-				*p++ = 0x0a;
+			fprintf(stderr, "__bench_run: open error (%s)\n", strerror(errno));
+			return -1;
 		}
-		else
+
+		if (__write_all(fd, text, size) < 0)
 		{
-			++p;
+			close(fd);
+			return -1;
 		}
-	}
-}
 
-/**
- * Map file into virtual memory.
- */
-static mapped_file_t *
-map_file(mapped_file_t *f)
-{
-	assert(f);
+		close(fd);
+		JOBS[i].size = size;
+		JOBS[i].status = 0;
+	}
 
-	char		*filename = f->filename;
-	int			flags;
-	struct stat statb;
+	reset_global();
+	global_data.total_bytes = (size * NR_JOBS);
+	NEXT_JOB = 0;
+	START_NS = start = __now_ns();
 
-	clear_struct(&statb);
-	if (lstat(filename, &statb) < 0)
-	{
-		fprintf(stderr, "map_file: lstat error (%s)\n", strerror(errno));
-		return NULL;
-	}
+	pthread_create(&TID_SP, NULL, show_progress, NULL);
 
-	f->map_size = f->current_file_size = f->original_file_size = statb.st_size;
+	for (i = 0; i < NR_WORKERS; ++i)
+		pthread_create(&workers[i], NULL, __worker, (void *)(intptr_t)i);
 
-	if ((f->fd = open(filename, O_RDWR)) < 0)
-	{
-		fprintf(stderr, "map_file: open error (%s)\n", strerror(errno));
-		return NULL;
-	}
+	for (i = 0; i < NR_WORKERS; ++i)
+		pthread_join(workers[i], NULL);
 
-	flags = 0;
-	flags |= MAP_SHARED;
+	end_progress();
 
-	if ((f->startp = mmap(NULL, f->original_file_size, PROT_READ|PROT_WRITE, flags, f->fd, 0)) == MAP_FAILED)
+	for (i = 0; i < NR_JOBS; ++i)
 	{
-		fprintf(stderr, "map_file: mmap error (%s)\n", strerror(errno));
-		return NULL;
+		if (JOBS[i].status == -1)
+			return -1;
 	}
 
-	f->flags = flags;
-	f->endp = (void *)((char *)f->startp + statb.st_size);
-
-	return f;
+	return ((double)(__now_ns() - start) / 1e9);
 }
 
 /**
- * Unmap file from virtual memory.
+ * Read the results from a baseline written by --bench-json.
+ * Only the one-result-per-line layout we write is understood.
  */
-static void
-unmap_file(mapped_file_t *f)
+static int
+__bench_load_baseline(char *path, bench_result_t *results, int max)
 {
-	assert(f);
+	FILE	*fp;
+	char	line[512];
+	char	*p;
+	int		nr = 0;
 
-	munmap(f->startp, f->map_size);
+	if (!(fp = fopen(path, "r")))
+	{
+		fprintf(stderr, "__bench_load_baseline: fopen error (%s)\n", strerror(errno));
+		return -1;
+	}
 
-	if (f->fd > 2)
-		close(f->fd);
+	while (nr < max && fgets(line, sizeof(line), fp))
+	{
+		if (!(p = strstr(line, "{\"op\":")))
+			continue;
 
-	clear_struct(f);
+		clear_struct(&results[nr]);
+		if (sscanf(p, "{\"op\":\"%31[^\"]\",\"size\":%zu,\"threads\":%d,\"seconds\":%lf,\"mb_s\":%lf",
+			results[nr].op, &results[nr].size, &results[nr].threads,
+			&results[nr].seconds, &results[nr].rate) == 5)
+			++nr;
+	}
 
-	return;
+	fclose(fp);
+	return nr;
 }
 
 static int
-check_file(char *filename)
+__bench_save(char *path, bench_result_t *results, int nr, int max_threads)
 {
-	struct stat	statb;
+	FILE	*fp;
+	int		i;
 
-	if (access(filename, F_OK) != 0)
-	{
-		fprintf(stderr, "check_file: %s does not exist\n", filename);
-		goto fail;
-	}
-	else
-	if (access(filename, R_OK) != 0)
-	{
-		fprintf(stderr, "check_file: cannot read %s\n", filename);
-		goto fail;
-	}
-	else
-	if (access(filename, W_OK) != 0)
+	if (!(fp = fopen(path, "w")))
 	{
-		fprintf(stderr, "check_file: cannot write to %s\n", filename);
-		goto fail;
+		fprintf(stderr, "__bench_save: fopen error (%s)\n", strerror(errno));
+		return -1;
 	}
 
-	clear_struct(&statb);
-	if (lstat(filename, &statb) < 0)
-	{
-		fprintf(stderr, "check_file: lstat error (%s)\n", strerror(errno));
-		goto fail;
-	}
+	fprintf(fp, "{\"bench\":\"ftext\",\"cpus\":%ld,\"max_threads\":%d,\"reps\":%d,\"results\":[\n",
+		sysconf(_SC_NPROCESSORS_ONLN), max_threads, BENCH_REPS);
 
-	if (!S_ISREG(statb.st_mode))
+	for (i = 0; i < nr; ++i)
 	{
-		fprintf(stderr, "check_file: %s is not a regular file\n", filename);
-		goto fail;
+		fprintf(fp, "{\"op\":\"%s\",\"size\":%zu,\"threads\":%d,\"seconds\":%.6f,\"mb_s\":%.3f,"
+			"\"speedup\":%.3f,\"efficiency\":%.3f,\"regression\":%s}%s\n",
+			results[i].op, results[i].size, results[i].threads, results[i].seconds,
+			results[i].rate, results[i].speedup, results[i].efficiency,
+			results[i].regression ? "true" : "false", (i + 1) < nr ? "," : "");
 	}
 
-	return 0;
+	fprintf(fp, "]}\n");
+	fclose(fp);
 
-	fail:
-	return -1;
+	return 0;
 }
 
+/**
+ * Run the benchmark with up to MAX_THREADS workers. Returns
+ * the number of regressions against the baseline, or -1.
+ */
 static int
-change_line_length(mapped_file_t *file)
+run_bench(int max_threads)
 {
-	assert(file);
+	bench_result_t	*results = NULL;
+	bench_result_t	*baseline = NULL;
+	size_t	sizes[BENCH_MAX_SIZES];
+	char		dir[PATH_MAX];
+	char		list[256];
+	char		*tmp;
+	char		*text = NULL;
+	char		*size_str;
+	char		*save_ptr = NULL;
+	double	secs;
+	double	best;
+	double	one_thread = 0;
+	int			nr_sizes = 0;
+	int			nr_results = 0;
+	int			nr_baseline = 0;
+	int			regressions = 0;
+	int			s;
+	int			o;
+	int			t;
+	int			r;
+	int			b;
+	int			i;
+
+	snprintf(list, sizeof(list), "%s", BENCH_SIZE_LIST);
+
+	for (size_str = strtok_r(list, ",", &save_ptr);
+		size_str && nr_sizes < BENCH_MAX_SIZES;
+		size_str = strtok_r(NULL, ",", &save_ptr))
+	{
+		if (!(sizes[nr_sizes++] = __parse_size(size_str)))
+		{
+			fprintf(stderr, "run_bench: invalid size (%s)\n", size_str);
+			return -1;
+		}
+	}
 
-	char	*p = (char *)file->startp;
-	char	*startp = (char *)file->startp;
-	char	*endp = (char *)file->endp;
-	char	*line_start = NULL;
-	char	*line_end = NULL;
+	if (!(results = calloc(BENCH_MAX_RESULTS, sizeof(bench_result_t)))
+	|| !(baseline = calloc(BENCH_MAX_RESULTS, sizeof(bench_result_t)))
+	|| !(JOBS = calloc(max_threads, sizeof(job_t))))
+	{
+		fprintf(stderr, "run_bench: failed to allocate memory (%s)\n", strerror(errno));
+		goto fail;
+	}
 
-	reset_global();
-	global_data.total_lines = __do_line_count(file);
+	if (BENCH_BASELINE && (nr_baseline = __bench_load_baseline(BENCH_BASELINE, baseline, BENCH_MAX_RESULTS)) < 0)
+		goto fail;
 
-	p = line_start = startp;
+	if (!(tmp = getenv("TMPDIR")))
+		tmp = "/tmp";
 
-	/*
-	 * We want to preserve paragraph structure, so if
-	 * we encounter two or more consecutive new lines,
-	 * we just skip them and then start a new line
-	 * from there.
-	 */
-	while (p < endp)
+	snprintf(dir, sizeof(dir), "%s/ftext-bench.XXXXXX", tmp);
+	if (!mkdtemp(dir))
 	{
-		__begin_next_line:
-		line_end = (p + MAX_LENGTH);
-
-		if (line_end > endp)
-			line_end = endp;
+		fprintf(stderr, "run_bench: mkdtemp error (%s)\n", strerror(errno));
+		goto fail;
+	}
 
-		line_start = p;
+	NR_JOBS = max_threads;
+	for (i = 0; i < NR_JOBS; ++i)
+	{
+		if (!(JOBS[i].name = malloc(PATH_MAX)))
+		{
+			fprintf(stderr, "run_bench: failed to allocate memory (%s)\n", strerror(errno));
+			goto out;
+		}
 
-		if (*line_end != 0x0a && *line_end != 0x20)
+		if (snprintf(JOBS[i].name, PATH_MAX, "%s/%d.txt", dir, i) >= PATH_MAX)
 		{
-			while (*line_end != 0x20 && *line_end != 0x0a && line_end > (line_start+1))
-				--line_end;
+			fprintf(stderr, "run_bench: path length exceeds PATH_MAX\n");
+			goto out;
+		}
+	}
 
-			if (unlikely(line_end == line_start))
-			{
-				line_end = (line_start + MAX_LENGTH);
+	fprintf(stdout, "%-6s %10s %8s %10s %10s %9s %10s\n",
+		"op", "size", "threads", "seconds", "MB/s", "speed-up", "efficiency");
 
-				if (line_end > endp)
-					line_end = endp;
-			}
+	for (s = 0; s < nr_sizes; ++s)
+	{
+		free(text);
+		if (!(text = __gen_text(sizes[s], 0x5eed + s)))
+		{
+			fprintf(stderr, "run_bench: failed to allocate memory (%s)\n", strerror(errno));
+			goto out;
 		}
 
-		/*
-		 * If we happen upon a new line character, then replace
-		 * it with a space. If we happen upon 2+ new line characters,
-		 * then we preserve them as we want to keep the correct
-		 * paragraph structure of the file.
-		 */
-		while (p < line_end)
+		for (o = 0; o < (int)NR_BENCH_OPS; ++o)
 		{
-			if (*p == 0x0a && (p+1) == endp)
-			{
-				++global_data.done_lines;
-				break;
-			}
-			else
-			if (*p == 0x0a && *(p+1) != 0x0a)
-			{
-				*p++ = 0x20;
-				++global_data.done_lines;
-			}
-			else
-			if (*p == 0x0a && *(p+1) == 0x0a)
-			{
-				while (*p == 0x0a)
-				{
-					++p;
-					++global_data.done_lines;
-				}
+			user_options = bench_ops[o].options;
+			MAX_LENGTH = bench_ops[o].length;
 
-				line_end = line_start = p;
-				goto __begin_next_line;
-			}
-			else
-			{
-				++p;
-			}
-		}
+			NR_PHASES = 1;
+			if (test_flag(LENGTH))
+				++NR_PHASES;
+			if (user_options & ALIGNMENT_MASK)
+				++NR_PHASES;
 
-		if (p < endp)
-		{
-			if (likely(*p == 0x20))
-			{
-				*p++ = 0x0a;
-			}
-			else
-			if (*p == 0x0a)
-			{
-				while (*p == 0x0a)
-				{
-					++p;
-					++global_data.done_lines;
-				}
-			}
-			else
-			if (*p != 0x20)
+			for (t = 1; nr_results < BENCH_MAX_RESULTS; t *= 2)
 			{
-				/*
-				 * Then we have a line with no whitespace. P and LINE_END
-				 * are pointing to one byte beyond the maximum number of
-				 * bytes per line.
-				 *
-				 * Policy at this point in time for such a scenario:
-				 *
-				 * Point P at LINE_START + MAX_LEN-1;
-				 * Shift data by 2 bytes;
-				 * Add "-\n", thus breaking the word with a hyphen.
-				 */
-
-				p = (line_start + MAX_LENGTH - 1);
-				size_t		shift;
-
-				if (unlikely(*p == 0x2d))
-				{
-					shift = 1;
-					++p;
-				}
-				else
-				if (unlikely(*(p-1) == 0x2d))
-				{
-					shift = 1;
-				}
-				else
+				bench_result_t	*res = &results[nr_results++];
+
+				if (t > max_threads)
+					t = max_threads;
+
+				NR_WORKERS = t;
+				best = 0;
+
+				for (r = 0; r < BENCH_REPS; ++r)
 				{
-					shift = 2;
-				}
+					if ((secs = __bench_run(text, sizes[s])) < 0)
+						goto out;
 
-				if (!__extend_file_and_map(file, shift))
-					goto fail;
+					if (!r || secs < best)
+						best = secs;
+				}
 
-				check_pointers();
+				if (t == 1)
+					one_thread = best;
 
-				__shift_file_data(file, (off_t)(p - startp), shift);
+				snprintf(res->op, sizeof(res->op), "%s", bench_ops[o].name);
+				res->size = sizes[s];
+				res->threads = t;
+				res->seconds = best;
+				res->rate = ((double)(sizes[s] * NR_JOBS) / best) / (1024 * 1024);
+				res->speedup = one_thread / best;
+				res->efficiency = res->speedup / t;
 
-				if (likely(shift == 2))
-					strncpy(p, "-\n", 2);
-				else
-					*p = 0x0a;
+				for (b = 0; b < nr_baseline; ++b)
+				{
+					if (!strcmp(baseline[b].op, res->op) && baseline[b].size == res->size
+					&& baseline[b].threads == res->threads
+					&& res->rate < baseline[b].rate * (1 - BENCH_TOLERANCE))
+					{
+						res->regression = 1;
+						++regressions;
+					}
+				}
 
-				p += shift;
+				fprintf(stdout, "%-6s %10zu %8d %10.4f %10.1f %9.2f %10.2f%s\n",
+					res->op, res->size, res->threads, res->seconds, res->rate,
+					res->speedup, res->efficiency, res->regression ? "  REGRESSION" : "");
+				fflush(stdout);
 
-				line_end = line_start = p;
+				if (t == max_threads)
+					break;
 			}
 		}
-
-		line_end = line_start = p;
 	}
 
-	pthread_join(TID_SP, NULL);
-	return 0;
+	if (BENCH_JSON && __bench_save(BENCH_JSON, results, nr_results, max_threads) < 0)
+		goto out;
 
-	fail:
-	return -1;
-}
+	if (regressions)
+		fprintf(stderr, "run_bench: %d result(s) more than %d%% slower than the baseline\n",
+			regressions, (int)(BENCH_TOLERANCE * 100));
 
-static int
-justify_text(mapped_file_t *file)
-{
-	assert(file);
+	for (i = 0; i < NR_JOBS; ++i)
+	{
+		unlink(JOBS[i].name);
+		free(JOBS[i].name);
+	}
 
-	char	*p = (char *)file->startp;
-	char	*startp = (char *)file->startp;
-	char	*endp = (char *)file->endp;
-	char	*line_start = NULL;
-	char	*line_end = NULL;
-	char	*left = NULL;
-	char	*right = NULL;
-	char	*save_p = NULL;
-	int		char_cnt = 0;
-	int		delta;
-	int		holes;
-	int		quotient;
-	int		remainder;
-	int		threshold;
+	rmdir(dir);
+	free(text);
+	free(results);
+	free(baseline);
+	free(JOBS);
 
-	reset_global();
-	global_data.total_lines = __do_line_count(file);
-	char_cnt = 0;
+	return regressions;
 
-	/*
-	 * If user did not specify a new line length, then
-	 * determine the longest line in the file, and
-	 * then justify the text accordingly.
-	 */
-	if (!test_flag(LENGTH))
-		MAX_LENGTH = __get_length_longest_line(file);
+	out:
+	for (i = 0; i < NR_JOBS; ++i)
+	{
+		if (!JOBS[i].name)
+			break;
 
-	threshold = MAX_LENGTH / 2;
+		unlink(JOBS[i].name);
+		free(JOBS[i].name);
+	}
 
-	while (p < endp)
-	{
-		__main_loop_justify_start:
+	rmdir(dir);
 
-		line_start = p;
-		char_cnt = 0;
+	fail:
+	free(text);
+	free(results);
+	free(baseline);
+	free(JOBS);
+	JOBS = NULL;
 
-		p = memchr(line_start, 0x0a, (endp - line_start));
+	return -1;
+}
 
-		if (!p)
-			line_end = endp;
-		else
-			line_end = p;
+/*
+ * What --analyze reports about a file: the widths of its lines and
+ * of its words (tokens: runs of bytes other than 0x20, 0x09, 0x0a
+ * and 0x0d), its CRs and its runs of blanks (0x20 and 0x09). Widths
+ * are counted exactly up to ANALYSE_WIDTHS-1; longer ones are put in
+ * the last bucket with them. A line's width is its bytes before the
+ * 0x0a, CRs and all.
+ */
+#define ANALYSE_WIDTHS	65536
 
-		char_cnt = (int)(line_end - line_start);
+typedef struct analysis_t
+{
+	size_t	bytes;
+	size_t	lines;
+	size_t	line_bytes;
+	size_t	longest_line;
+	size_t	crs;
+	size_t	tabs;
+	size_t	tokens;
+	size_t	longest_token;
+	size_t	blank_runs;				/* runs of two or more blanks */
+	size_t	blank_excess;			/* bytes squeezing them down to one would drop */
+	size_t	longest_blank_run;
+	size_t	line_widths[ANALYSE_WIDTHS];
+	size_t	token_widths[ANALYSE_WIDTHS];
+} analysis_t;
+
+typedef struct analyse_job_t
+{
+	pthread_t		tid;
+	int					started;
+	const char	*p;
+	size_t			len;
+	analysis_t	*a;
+} analyse_job_t;
 
-		while (*line_end == 0x0a)
-		{
-			++line_end;
-			++global_data.done_lines;
-		}
+#define __analyse_bucket(w) ((w) < ANALYSE_WIDTHS ? (w) : ANALYSE_WIDTHS - 1)
 
-		/*
-		 * Short lines with more spaces than there are
-		 * letters are not aesthetically pleasing. So
-		 * just leave them alone.
-		 */
-		if (MAX_LENGTH == char_cnt || char_cnt <= threshold)
+/*
+ * Add LEN bytes at P, which start at the start of a line, to A.
+ * The new lines, blanks and everything else are found 64 bytes at
+ * a time as bitmaps, and a word or a run of blanks is then only
+ * looked at where the bitmaps change, at its ends.
+ */
+multiversion
+static void
+__analyse_scan(analysis_t *a, const char *p, size_t len)
+{
+	uint64_t	nl;
+	uint64_t	bl;
+	uint64_t	ws;
+	uint64_t	cr;
+	uint64_t	tab;
+	uint64_t	t;
+	uint64_t	ws_carry = 1;
+	uint64_t	bl_carry = 0;
+	size_t		line = 0;
+	size_t		token = 0;
+	size_t		run = 0;
+	size_t		i;
+	size_t		k;
+	size_t		n;
+
+	a->bytes += len;
+
+	for (i = 0; i < len; i += 64)
+	{
+		if ((i + 64) <= len)
 		{
-			p = line_start = line_end;
-			continue;
+			nl = __eq_mask64(p + i, 0x0a);
+			cr = __eq_mask64(p + i, 0x0d);
+			tab = __eq_mask64(p + i, 0x09);
+			bl = (__eq_mask64(p + i, 0x20) | tab);
+			ws = (nl | cr | bl);
 		}
 		else
 		{
-			delta = holes = quotient = remainder = 0;
-
-			p = line_start;
-
-			/*
-			 * calculate (#words - 1).
-			 */
-			while (p < line_end)
-			{
-				if (*p == 0x20)
-					++holes;
-
-				++p;
-			}
-
-			/*
-			 * Then we can't justify it (adding
-			 * spaces to the end of the line makes
-			 * no difference visually).
-			 */
-			if (holes == 0)
+			for (nl = cr = tab = bl = 0, k = i; k < len; ++k)
 			{
-				p = line_start = line_end;
-				goto __main_loop_justify_start;
+				nl |= ((uint64_t)(p[k] == 0x0a) << (k - i));
+				cr |= ((uint64_t)(p[k] == 0x0d) << (k - i));
+				tab |= ((uint64_t)(p[k] == 0x09) << (k - i));
+				bl |= ((uint64_t)(p[k] == 0x20 || p[k] == 0x09) << (k - i));
 			}
 
-			delta = (MAX_LENGTH - char_cnt);
-			quotient = (delta / holes);
-			remainder = (delta % holes);
-
-			p = line_start;
-
 			/*
-			 * ^An example line in the file which is shorter than the max$
-			 * ^__________________________________________________________--------------$ max length
-			 *                                                                 delta
-			 *
-			 * We need to add DELTA spaces to the line to justify it. With the number
-			 * of holes in the current line known, we need to go over the line
-			 * QUOTIENT times, adding an additional space between each word
-			 * in the line. If (DELTA % HOLES), then must also spread that number of
-			 * additional spaces across the current line.
+			 * Past the end counts as white space,
+			 * to end the last word.
 			 */
+			ws = (nl | cr | bl | ~((1ULL << (len - i)) - 1));
+		}
 
-			if (!__extend_file_and_map(file, (off_t)delta))
-				goto fail;
+		a->crs += __builtin_popcountll(cr);
+		a->tabs += __builtin_popcountll(tab);
 
-			check_pointers();
+		for (t = (ws ^ ((ws << 1) | ws_carry)); t; t &= (t - 1))
+		{
+			k = (i + __builtin_ctzll(t));
 
-			/*
-			 * Loop until we have passed over the line QUOTIENT times,
-			 * adding one additional space between each word.
-			 */
-			while (quotient)
+			if (!((ws >> (k - i)) & 1))
 			{
-				if (p == line_end)
-				{
-					p = line_start;
-					--quotient;
-					continue;
-				}
-
-				save_p = p;
-				p = memchr(save_p, 0x20, (line_end - save_p));
-
-				if (!p)
-				{
-					p = line_end;
-					continue;
-				}
+				token = k;
+				continue;
+			}
 
-				__shift_file_data(file, (off_t)(p - startp), (size_t)1);
-				++line_end;
+			n = (k - token);
+			++a->tokens;
+			++a->token_widths[__analyse_bucket(n)];
+			if (n > a->longest_token)
+				a->longest_token = n;
+		}
 
-				*p++ = 0x20;
+		for (t = (bl ^ ((bl << 1) | bl_carry)); t; t &= (t - 1))
+		{
+			k = (i + __builtin_ctzll(t));
 
-				while (*p == 0x20)
-					++p;
+			if ((bl >> (k - i)) & 1)
+			{
+				run = k;
+				continue;
 			}
 
-
-			/*
-			 * Go from start -> space, add space; go from end -> space, add space
-			 * until REMAINDER spaces have been added to the line.
-			 */
-			int	_switch = 0;
-			if (remainder)
+			if ((n = (k - run)) > 1)
 			{
-				p = left = line_start;
-				right = (line_end - 1);
-
-				while (remainder > 0)
-				{
-					if (!_switch)
-					{
-						p = memchr(left, 0x20, (right - left));
+				++a->blank_runs;
+				a->blank_excess += (n - 1);
+				if (n > a->longest_blank_run)
+					a->longest_blank_run = n;
+			}
+		}
 
-						if (!p)
-						{
-							left = line_start;
-							right = (line_end - 1);
+		ws_carry = (ws >> 63);
+		bl_carry = (bl >> 63);
 
-							_switch = 1;
-							continue;
-						}
+		for (; nl; nl &= (nl - 1))
+		{
+			k = (i + __builtin_ctzll(nl));
+			n = (k - line);
 
-						__shift_file_data(file, (off_t)(p - startp), (size_t)1);
-						++line_end;
-						++right;
+			++a->lines;
+			a->line_bytes += n;
+			++a->line_widths[__analyse_bucket(n)];
+			if (n > a->longest_line)
+				a->longest_line = n;
 
-						*p++ = 0x20;
-						--remainder;
+			line = (k + 1);
+		}
+	}
 
-						_switch = 1;
+	/*
+	 * A word, run of blanks or line still open at the end.
+	 */
+	if (!ws_carry)
+	{
+		n = (len - token);
+		++a->tokens;
+		++a->token_widths[__analyse_bucket(n)];
+		if (n > a->longest_token)
+			a->longest_token = n;
+	}
 
-						left = p;
+	if (bl_carry && (n = (len - run)) > 1)
+	{
+		++a->blank_runs;
+		a->blank_excess += (n - 1);
+		if (n > a->longest_blank_run)
+			a->longest_blank_run = n;
+	}
 
-						while (*left == 0x20)
-							++left;
+	if (line < len)
+	{
+		n = (len - line);
+		++a->lines;
+		a->line_bytes += n;
+		++a->line_widths[__analyse_bucket(n)];
+		if (n > a->longest_line)
+			a->longest_line = n;
+	}
+}
 
-					}
-					else
-					{
-						p = right;
+static void
+__analyse_join(analysis_t *a, const analysis_t *b)
+{
+	size_t	i;
+
+	a->bytes += b->bytes;
+	a->lines += b->lines;
+	a->line_bytes += b->line_bytes;
+	a->crs += b->crs;
+	a->tabs += b->tabs;
+	a->tokens += b->tokens;
+	a->blank_runs += b->blank_runs;
+	a->blank_excess += b->blank_excess;
+
+	if (b->longest_line > a->longest_line)
+		a->longest_line = b->longest_line;
+	if (b->longest_token > a->longest_token)
+		a->longest_token = b->longest_token;
+	if (b->longest_blank_run > a->longest_blank_run)
+		a->longest_blank_run = b->longest_blank_run;
+
+	for (i = 0; i < ANALYSE_WIDTHS; ++i)
+	{
+		a->line_widths[i] += b->line_widths[i];
+		a->token_widths[i] += b->token_widths[i];
+	}
+}
 
-						while (*p != 0x20 && p > left)
-							--p;
+static void *
+__analyse_worker(void *arg)
+{
+	analyse_job_t	*job = (analyse_job_t *)arg;
 
-						if (p == left)
-						{
-							right = (line_end - 1);
-							left = line_start;
+	__analyse_scan(job->a, job->p, job->len);
+	return NULL;
+}
 
-							_switch = 0;
-							continue;
-						}
+/*
+ * Analyse the SIZE bytes at P into A. The file is cut into pieces
+ * at new lines, so that no line, word or run of blanks is split
+ * between two of them, and they are scanned in parallel as in
+ * get_line_stats().
+ */
+static int
+__analyse(analysis_t *a, const char *p, size_t size)
+{
+	analyse_job_t	jobs[LINE_STATS_MAX_PIECES];
+	const char		*nl;
+	int						nr_pieces = __nr_pieces(size);
+	size_t				piece = (size / nr_pieces);
+	size_t				off = 0;
+	size_t				end;
+	int						ret = 0;
+	int						i;
+
+	clear_struct(&jobs);
+	jobs[0].a = a;
+
+	for (i = 0; i < nr_pieces; ++i)
+	{
+		end = size;
 
-						__shift_file_data(file, (off_t)(p - startp), (size_t)1);
-						++line_end;
-						++right;
+		if (i < (nr_pieces - 1) && (end = ((i + 1) * piece)) > off)
+			end = ((nl = memchr(p + end, 0x0a, size - end)) ? (size_t)(nl - p) + 1 : size);
+		else
+		if (i < (nr_pieces - 1))
+			end = off;
 
-						*p-- = 0x20;
-						--remainder;
+		jobs[i].p = (p + off);
+		jobs[i].len = (end - off);
+		off = end;
 
-						right = p;
+		if (!i)
+			continue;
 
-						while (*right == 0x20)
-							--right;
+		if (!(jobs[i].a = calloc(1, sizeof(analysis_t))))
+		{
+			fprintf(stderr, "__analyse: failed to allocate memory (%s)\n", strerror(errno));
+			ret = -1;
+			break;
+		}
 
-						_switch = 0;
+		/*
+		 * If we can't have another thread, just do it ourselves.
+		 */
+		jobs[i].started = (pthread_create(&jobs[i].tid, NULL, __analyse_worker, (void *)&jobs[i]) == 0);
 
-					}
-				}
-			} // if (remainder)
+		if (!jobs[i].started)
+			__analyse_scan(jobs[i].a, jobs[i].p, jobs[i].len);
+	}
 
-			p = line_start = line_end;
+	__analyse_scan(a, jobs[0].p, jobs[0].len);
 
-		} // else (MAX_COUNT != char_cnt && char_cnt > third_max)
-	} // while (p < endp)
+	for (i = 1; i < nr_pieces && jobs[i].a; ++i)
+	{
+		if (jobs[i].started)
+			pthread_join(jobs[i].tid, NULL);
 
-	pthread_join(TID_SP, NULL);
-	return 0;
+		__analyse_join(a, jobs[i].a);
+		free(jobs[i].a);
+	}
 
-	fail:
-	pthread_kill(TID_SP, SIGINT);
-	return -1;
+	return ret;
 }
 
-static int
-unjustify_text(mapped_file_t *file)
+/*
+ * The smallest width that at least Q of the TOTAL counted in
+ * HIST are no wider than (0 if nothing was counted).
+ */
+static size_t
+__percentile(const size_t *hist, size_t total, double q)
 {
-	assert(file);
+	size_t	want = (size_t)ceil(q * (double)total);
+	size_t	seen = 0;
+	size_t	w;
 
-	/*
-	 * __unjustify_text() is called in __normalise_file()
-	 */
-	reset_global();
-	global_data.done_lines = __do_line_count(file);
+	if (!total)
+		return 0;
 
-	pthread_join(TID_SP, NULL);
-	return 0;
+	if (!want)
+		want = 1;
+
+	for (w = 0; w < (ANALYSE_WIDTHS - 1); ++w)
+	{
+		if ((seen += hist[w]) >= want)
+			break;
+	}
+
+	return w;
 }
 
-static int
-left_align_text(mapped_file_t *file)
+/*
+ * How many of those counted in HIST are wider than WIDTH.
+ */
+static size_t
+__count_wider(const size_t *hist, size_t width)
 {
-	assert(file);
-
-	reset_global();
-	global_data.total_lines = __do_line_count(file);
+	size_t	n = 0;
+	size_t	w;
 
-	while (global_data.done_lines < global_data.total_lines)
-		++global_data.done_lines;
+	for (w = (width + 1); w < ANALYSE_WIDTHS; ++w)
+		n += hist[w];
 
-	pthread_join(TID_SP, NULL);
-	return 0;
+	return n;
 }
 
-static int
-right_align_text(mapped_file_t *file)
+static void
+__print_widths(FILE *fp, const char *name, const size_t *hist, size_t nr, size_t sum, size_t longest)
 {
-	assert(file);
-
-	char		*p = (char *)file->startp;
-	char		*startp = (char *)file->startp;
-	char		*endp = (char *)file->endp;
-	char		*line_start = NULL;
-	char		*line_end = NULL;
-	int			delta;
-	int			char_cnt = 0;
+	size_t	w;
+	int			first = 1;
 
-	reset_global();
-	global_data.total_lines = __do_line_count(file);
+	fprintf(fp, ",\"%s\":{\"count\":%zu,\"mean\":%.2f,\"max\":%zu,\"p50\":%zu,\"p90\":%zu,\"p99\":%zu,\"p999\":%zu,\"histogram\":{",
+		name, nr, (nr ? (double)sum / (double)nr : 0.0), longest, __percentile(hist, nr, 0.5),
+		__percentile(hist, nr, 0.9), __percentile(hist, nr, 0.99), __percentile(hist, nr, 0.999));
 
-	if (!test_flag(LENGTH))
-		MAX_LENGTH = __get_length_longest_line(file);
-		
-	while (p < endp)
+	for (w = 0; w < ANALYSE_WIDTHS; ++w)
 	{
-		line_start = p;
-		char_cnt = 0;
-
-		p = memchr(line_start, 0x0a, (endp - line_start));
+		if (!hist[w])
+			continue;
 
-		if (!p)
-			line_end = endp;
-		else
-			line_end = p;
+		fprintf(fp, "%s\"%zu\":%zu", (first ? "" : ","), w, hist[w]);
+		first = 0;
+	}
 
-		char_cnt = (int)(line_end - line_start);
+	fputs("}}", fp);
+}
 
-		delta = (MAX_LENGTH - char_cnt);
+/*
+ * Analyse the file NAME and write what was found to standard
+ * output as one line of JSON. For each line length given with -L
+ * (or, without -L, each of those there are specialised engines
+ * for), it says how many lines are longer, which is how many a
+ * wrap would have to break, and how many words are longer, which
+ * is how many it would have to break with a hyphen.
+ */
+static int
+analyse_file(char *name)
+{
+	analysis_t	*a;
+	const char	*p = NULL;
+	size_t			size;
+	int					defaults[] = {
+#define __WIDTH_ENTRY(w) (w),
+		SPECIALISED_WIDTHS(__WIDTH_ENTRY)
+#undef __WIDTH_ENTRY
+	};
+	int					*widths = (NR_WIDTHS ? WIDTHS : defaults);
+	int					nr_widths = (NR_WIDTHS ? NR_WIDTHS : (int)(sizeof(defaults) / sizeof(defaults[0])));
+	size_t			sum_tokens = 0;
+	size_t			w;
+	int					ret = -1;
+	int					i;
+
+	if (!(a = calloc(1, sizeof(analysis_t))))
+	{
+		fprintf(stderr, "analyse_file: failed to allocate memory (%s)\n", strerror(errno));
+		return -1;
+	}
 
-		if (!__extend_file_and_map(file, (size_t)delta))
-			goto fail;
+	if (map_input(name, &p, &size) < 0)
+		goto out;
 
-		check_pointers();
+	if (p && __analyse(a, p, size) < 0)
+		goto out;
 
-		__shift_file_data(file, (off_t)(line_start - startp), (off_t)delta);
-		line_end += delta;
+	for (w = 0; w < ANALYSE_WIDTHS; ++w)
+		sum_tokens += (w * a->token_widths[w]);
 
-		p = (line_start + delta);
+	fputs("{\"file\":", stdout);
+	__json_string(stdout, name);
+	fprintf(stdout, ",\"bytes\":%zu,\"lines\":%zu,\"blank_lines\":%zu,\"crs\":%zu,\"tabs\":%zu",
+		a->bytes, a->lines, a->line_widths[0], a->crs, a->tabs);
 
-		memset(line_start, 0x20, (p - line_start));
+	__print_widths(stdout, "line_widths", a->line_widths, a->lines, a->line_bytes, a->longest_line);
+	__print_widths(stdout, "token_widths", a->token_widths, a->tokens, sum_tokens, a->longest_token);
 
-		while (*line_end == 0x0a)
-		{
-			++line_end;
-			++global_data.done_lines;
-		}
+	fprintf(stdout, ",\"blank_runs\":{\"count\":%zu,\"excess_bytes\":%zu,\"longest\":%zu},\"widths\":[",
+		a->blank_runs, a->blank_excess, a->longest_blank_run);
 
-		p = line_start = line_end;
+	for (i = 0; i < nr_widths; ++i)
+	{
+		fprintf(stdout, "%s{\"width\":%d,\"long_lines\":%zu,\"long_tokens\":%zu}", (i ? "," : ""), widths[i],
+			__count_wider(a->line_widths, (size_t)widths[i]), __count_wider(a->token_widths, (size_t)widths[i]));
 	}
 
-	pthread_join(TID_SP, NULL);
-	return 0;
+	fputs("]}\n", stdout);
+	fflush(stdout);
+	ret = 0;
 
-	fail:
-	pthread_kill(TID_SP, SIGINT);
-	return -1;
+	out:
+	if (p)
+		munmap((void *)p, size);
+
+	free(a);
+	return ret;
 }
 
-static int
-centre_align_text(mapped_file_t *file)
+/*
+ * Options that only have a long form.
+ */
+#define OPT_PROGRESS_FD	0x100
+#define OPT_STATS				0x101
+#define OPT_PERF_COUNTERS	0x102
+#define OPT_CHECK_BOUNDS	0x103
+#define OPT_BENCH					0x104
+#define OPT_BENCH_JSON		0x105
+#define OPT_BENCH_BASELINE	0x106
+#define OPT_GEN_CORPUS		0x107
+#define OPT_CRLF					0x108
+#define OPT_HYPHENS				0x109
+#define OPT_FOLD					0x10a
+#define OPT_SPLIT_ONLY		0x10b
+#define OPT_INCREMENTAL		0x10c
+#define OPT_CHECKPOINT		0x10d
+#define OPT_RESUME				0x10e
+#define OPT_ANALYSE				0x10f
+#define OPT_DRY_RUN				0x110
+#define OPT_RESERVE				0x111
+
+static struct option	long_options[] =
 {
-	assert(file);
-
-	char	*p = (char *)file->startp;
-	char	*startp = (char *)file->startp;
-	char	*endp = (char *)file->endp;
-	char	*line_start = NULL;
-	char	*line_end = NULL;
-	int		char_cnt;
-	int		delta;
-	int		half_delta;
-
-	reset_global();
-	global_data.total_lines = __do_line_count(file);
+	{ "progress-fd", required_argument, NULL, OPT_PROGRESS_FD },
+	{ "stats", no_argument, NULL, OPT_STATS },
+	{ "perf-counters", no_argument, NULL, OPT_PERF_COUNTERS },
+	{ "check-bounds", no_argument, NULL, OPT_CHECK_BOUNDS },
+	{ "bench", optional_argument, NULL, OPT_BENCH },
+	{ "bench-json", required_argument, NULL, OPT_BENCH_JSON },
+	{ "bench-baseline", required_argument, NULL, OPT_BENCH_BASELINE },
+	{ "gen-corpus", required_argument, NULL, OPT_GEN_CORPUS },
+	{ "crlf", no_argument, NULL, OPT_CRLF },
+	{ "hyphens", required_argument, NULL, OPT_HYPHENS },
+	{ "fold", required_argument, NULL, OPT_FOLD },
+	{ "split-only", no_argument, NULL, OPT_SPLIT_ONLY },
+	{ "incremental", no_argument, NULL, OPT_INCREMENTAL },
+	{ "checkpoint", optional_argument, NULL, OPT_CHECKPOINT },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ "analyze", no_argument, NULL, OPT_ANALYSE },
+	{ "analyse", no_argument, NULL, OPT_ANALYSE },
+	{ "dry-run", no_argument, NULL, OPT_DRY_RUN },
+	{ "reserve", no_argument, NULL, OPT_RESERVE },
+	{ "help", no_argument, NULL, 0x68 },
+	{ NULL, 0, NULL, 0 }
+};
 
-	if (!test_flag(LENGTH))
-		MAX_LENGTH = __get_length_longest_line(file);
+/**
+ * Stream events to the file descriptor given
+ * with --progress-fd (which must already be open).
+ */
+static int
+open_progress_fd(char *arg)
+{
+	char	*e;
+	long	fd;
 
-	while (p < endp)
+	fd = strtol(arg, &e, 10);
+	if (e == arg || *e || fd < 0 || fd > INT_MAX)
 	{
-		line_start = p;
-		char_cnt = 0;
-
-		p = memchr(line_start, 0x0a, (endp - line_start));
-
-		if (!p)
-			line_end = endp;
-		else
-			line_end = p;
-
-		char_cnt = (int)(line_end - line_start);
-		delta = (MAX_LENGTH - char_cnt);
-		half_delta = ((delta / 2) + (delta % 2));
-
-		if (!__extend_file_and_map(file, (size_t)half_delta))
-			goto fail;
+		fprintf(stderr, "open_progress_fd: invalid file descriptor (%s)\n", arg);
+		return -1;
+	}
 
-		check_pointers();
+	if (fcntl((int)fd, F_GETFL) < 0)
+	{
+		fprintf(stderr, "open_progress_fd: bad file descriptor %ld (%s)\n", fd, strerror(errno));
+		return -1;
+	}
 
-		p = line_start;
+	if (!(EVENT_FP = fdopen((int)fd, "w")))
+	{
+		fprintf(stderr, "open_progress_fd: fdopen error (%s)\n", strerror(errno));
+		return -1;
+	}
 
-#ifdef DEBUG
-#endif
+	return 0;
+}
 
-		__shift_file_data(file, (off_t)(p - startp), (size_t)half_delta);
+/**
+ * Parse the argument to -L: one line length, or several
+ * separated by commas.
+ */
+static int
+parse_widths(char *arg)
+{
+	char	*p = arg;
+	char	*e;
+	long	width;
 
-		line_end += half_delta;
-		p = (line_start + half_delta);
+	NR_WIDTHS = 0;
 
-		memset(line_start, 0x20, (p - line_start));
+	for (;;)
+	{
+		width = strtol(p, &e, 10);
+		if (e == p || (*e && *e != 0x2c))
+		{
+			fprintf(stderr, "parse_widths: invalid line length (%s)\n", arg);
+			return -1;
+		}
 
-#ifdef DEBUG
-#endif
+		if (width < 2 || width > INT_MAX)
+		{
+			fprintf(stderr, "main: line length must be at least 2\n");
+			return -1;
+		}
 
-		while (*line_end == 0x0a && line_end < endp)
+		if (NR_WIDTHS == MAX_WIDTHS)
 		{
-			++line_end;
-			++global_data.done_lines;
+			fprintf(stderr, "parse_widths: too many line lengths (at most %d)\n", MAX_WIDTHS);
+			return -1;
 		}
 
-		p = line_start = line_end;
-	}
+		WIDTHS[NR_WIDTHS++] = (int)width;
 
-	pthread_join(TID_SP, NULL);
-	return 0;
+		if (!*e)
+			return 0;
 
-	fail:
-	pthread_kill(TID_SP, SIGINT);
-	return -1;
+		p = (e + 1);
+	}
 }
 
 int
 main(int argc, char *argv[])
 {
-	char		c;
+	pthread_t		*workers = NULL;
+	struct stat	statb;
+	int					c;
+	int					i;
+	int					failed = 0;
+	int					bench = 0;
+	int					threads_set = 0;
 
 	/*
-	 * Minimum number of args is 3, e.g. 'ftext -j file.txt`
+	 * Minimum number of args is 3, e.g. 'ftext -j file.txt`,
+	 * or 2 for 'ftext --bench'.
 	 */
-	if (argc < 3)
+	if (argc < 2)
 		usage(EXIT_FAILURE);
 
-	/*
-	 * Must be done here and not in some constructor function
-	 * because the terminal window dimensions are not known
-	 * before main() is called.
-	 */
-	clear_struct(&WINSIZE);
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &WINSIZE);
-	setvbuf(stdout, NULL, _IONBF, 0);
-
-	clear_struct(&global_data);
-	//pthread_attr_setdetachstate(&tATTR, PTHREAD_CREATE_DETACHED);
+	reset_global();
+	select_kernels();
+	NR_CPUS = (int)sysconf(_SC_NPROCESSORS_ONLN);
 
 	opterr = 0;
-	while ((c = getopt(argc, argv, "L:lrcjuh")) != -1)
+	while ((c = getopt_long(argc, argv, "L:lrcjut:o:h", long_options, NULL)) != -1)
 	{
 		switch(c)
 		{
+			case(OPT_PROGRESS_FD):
+			if (open_progress_fd(optarg) < 0)
+				goto fail;
+			break;
+			case(OPT_STATS):
+			SHOW_STATS = 1;
+			break;
+			case(OPT_CRLF):
+			set_flag(CRLF);
+			break;
+			case(OPT_HYPHENS):
+			if (!strcmp(optarg, "soft"))
+				HYPHEN_POLICY = HYPHEN_SOFT;
+			else
+			if (!strcmp(optarg, "hard"))
+				HYPHEN_POLICY = HYPHEN_HARD;
+			else
+			{
+				fprintf(stderr, "main: --hyphens must be soft or hard\n");
+				goto fail;
+			}
+			break;
+			case(OPT_FOLD):
+			FOLD_WIDTH = atoi(optarg);
+			if (FOLD_WIDTH < 1)
+			{
+				fprintf(stderr, "main: --fold needs a width of at least 1\n");
+				goto fail;
+			}
+			set_flag(FOLD);
+			break;
+			case(OPT_INCREMENTAL):
+			set_flag(INCREMENTAL);
+			break;
+			case(OPT_CHECKPOINT):
+			if (optarg && !(CHECKPOINT_EVERY = __parse_size(optarg)))
+			{
+				fprintf(stderr, "main: invalid checkpoint interval (%s)\n", optarg);
+				goto fail;
+			}
+			set_flag(CHECKPOINT);
+			break;
+			case(OPT_RESUME):
+			set_flag(CHECKPOINT|RESUME);
+			break;
+			case(OPT_ANALYSE):
+			set_flag(ANALYSE);
+			break;
+			case(OPT_DRY_RUN):
+			set_flag(DRY_RUN);
+			break;
+			case(OPT_RESERVE):
+			set_flag(RESERVE);
+			break;
+			case(OPT_SPLIT_ONLY):
+			set_flag(SPLIT_ONLY);
+			break;
+			case(OPT_PERF_COUNTERS):
+			PERF_COUNTERS = 1;
+			SHOW_STATS = 1;
+			break;
+			case(OPT_CHECK_BOUNDS):
+#ifndef ACCOUNTING
+			fprintf(stderr, "main: --check-bounds needs a build with 'make ACCOUNTING=1'\n");
+			goto fail;
+#endif
+			CHECK_BOUNDS = 1;
+			break;
+			case(OPT_BENCH):
+			bench = 1;
+			if (optarg)
+				BENCH_SIZE_LIST = optarg;
+			break;
+			case(OPT_BENCH_JSON):
+			BENCH_JSON = optarg;
+			break;
+			case(OPT_BENCH_BASELINE):
+			BENCH_BASELINE = optarg;
+			break;
+			case(OPT_GEN_CORPUS):
+			exit(gen_corpus(optarg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+			break;
 			case(0x68):
 			usage(EXIT_SUCCESS);
 			break;
@@ -1573,17 +7916,30 @@ main(int argc, char *argv[])
 			set_flag(CALIGN);
 			break;
 			case(0x4c):
-			MAX_LENGTH = atoi(optarg);
+			if (parse_widths(optarg) < 0)
+				goto fail;
+			MAX_LENGTH = WIDTHS[0];
 			set_flag(LENGTH);
 			break;
+			case(0x6f):
+			OUTPUT_TEMPLATE = optarg;
+			break;
 			case(0x6a):
 			set_flag(JUSTIFY);
 			break;
 			case(0x75):
 			set_flag(UNJUSTIFY);
 			break;
+			case(0x74):
+			NR_WORKERS = atoi(optarg);
+			if (NR_WORKERS < 1)
+				NR_WORKERS = (int)sysconf(_SC_NPROCESSORS_ONLN);
+			if (NR_WORKERS > MAX_WORKERS)
+				NR_WORKERS = MAX_WORKERS;
+			threads_set = 1;
+			break;
 			case(0x3f):
-			fprintf(stderr, "main: invalid option ('%c')\n", c);
+			fprintf(stderr, "main: invalid option ('%c')\n", optopt);
 			exit(EXIT_FAILURE);
 			break;
 			default:
@@ -1593,75 +7949,153 @@ main(int argc, char *argv[])
 
 	test_user_options();
 
-	if (check_file(argv[optind]) == -1)
-		goto fail;
+	if (bench)
+	{
+		if (!threads_set)
+			NR_WORKERS = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (NR_WORKERS > MAX_WORKERS)
+			NR_WORKERS = MAX_WORKERS;
+
+		exit(run_bench(NR_WORKERS) != 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
 
-	if (strlen(argv[optind]) >= PATH_MAX)
+	if (optind >= argc)
+		usage(EXIT_FAILURE);
+
+	NR_JOBS = (argc - optind);
+
+	if (!(JOBS = calloc(NR_JOBS, sizeof(job_t))))
 	{
-		fprintf(stderr, "main: path length exceeds PATH_MAX\n");
+		fprintf(stderr, "main: failed to allocate memory for jobs (%s)\n", strerror(errno));
 		goto fail;
 	}
 
-	clear_struct(&file);
-	strcpy(file.filename, argv[optind]);
+	for (i = 0; i < NR_JOBS; ++i)
+	{
+		char	*name = argv[optind + i];
+
+		if (check_file(name) == -1)
+			goto fail;
+
+		if (strlen(name) >= PATH_MAX)
+		{
+			fprintf(stderr, "main: path length exceeds PATH_MAX\n");
+			goto fail;
+		}
+
+		clear_struct(&statb);
+		if (lstat(name, &statb) < 0)
+		{
+			fprintf(stderr, "main: lstat error (%s)\n", strerror(errno));
+			goto fail;
+		}
+
+		JOBS[i].name = name;
+		JOBS[i].size = statb.st_size;
+		global_data.total_bytes += statb.st_size;
+	}
 
-	if (!(map_file(&file)))
+	if (OUTPUT_TEMPLATE && NR_JOBS > 1)
+	{
+		fprintf(stderr, "main: -o takes only one file\n");
 		goto fail;
+	}
 
 	/*
-	 * Remove 0x0d's, remove "-\n"
+	 * Nothing is written, so the files are done one after
+	 * the other, each shared out over all the CPUs.
 	 */
-	__normalise_file(&file);
+	if (test_flag(ANALYSE))
+	{
+		NR_WORKERS = 1;
 
-	clear();
-	fill();
-	up(6);
-	POSITION = 6;
-	print_fileinfo(argv[optind]);
-	down(POSITION-2);
+		for (i = 0; i < NR_JOBS; ++i)
+		{
+			if (analyse_file(JOBS[i].name) < 0)
+				failed = 1;
+		}
 
-	if (test_flag(LENGTH))
+		free(JOBS);
+		exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (test_flag(DRY_RUN))
 	{
-		pthread_create(&TID_SP, NULL, show_progress, (void *)STR_PROGRESS_LENGTH);
-		usleep(10000);
-		if (change_line_length(&file) == -1)
-			goto fail;
+		for (i = 0; i < NR_JOBS; ++i)
+		{
+			if (dry_run_file(JOBS[i].name) < 0)
+				failed = 1;
+		}
+
+		free(JOBS);
+		exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (NR_WORKERS > NR_JOBS)
+		NR_WORKERS = NR_JOBS;
+
+	/*
+	 * --split-only takes the place of the normaliser.
+	 */
+	NR_PHASES = 1;
+	if (test_flag(LENGTH) && !test_flag(SPLIT_ONLY))
+		++NR_PHASES;
+	if (user_options & ALIGNMENT_MASK)
+		NR_PHASES += (OUTPUT_TEMPLATE ? NR_WIDTHS : 1);
+
+	/*
+	 * Must be done here and not in some constructor function
+	 * because the terminal window dimensions are not known
+	 * before main() is called.
+	 */
+	if (render_init() < 0)
+		goto fail;
+
+	if (!dashboard_mode())
+		print_fileinfo(JOBS[0].name);
+
+	START_NS = __now_ns();
+	pthread_create(&TID_SP, NULL, show_progress, NULL);
+
+	if (!(workers = calloc(NR_WORKERS, sizeof(pthread_t))))
+	{
+		fprintf(stderr, "main: failed to allocate memory for workers (%s)\n", strerror(errno));
+		end_progress();
+		goto fail;
+	}
+
+	for (i = 0; i < NR_WORKERS; ++i)
+		pthread_create(&workers[i], NULL, __worker, (void *)(intptr_t)i);
+
+	for (i = 0; i < NR_WORKERS; ++i)
+		pthread_join(workers[i], NULL);
+
+	end_progress();
+	render_finish();
+
+	if (SHOW_STATS)
+		print_stats();
+
+	for (i = 0; i < NR_JOBS; ++i)
+	{
+		if (JOBS[i].status == -1)
+			failed = 1;
 	}
 
-	uint32_t		alignment = user_options & ALIGNMENT_MASK;
-	switch(alignment)
+#ifdef ACCOUNTING
+	if (ACCT_VIOLATIONS)
 	{
-		case JUSTIFY:
-			pthread_create(&TID_SP, NULL, show_progress, (void *)STR_PROGRESS_JUSTIFY);
-			if (justify_text(&file) == -1)
-				goto fail;
-			break;
-		case UNJUSTIFY:
-			pthread_create(&TID_SP, NULL, show_progress, (void *)STR_PROGRESS_UNJUSTIFY);
-			if (unjustify_text(&file) == -1)
-				goto fail;
-			break;
-		case LALIGN:
-			pthread_create(&TID_SP, NULL, show_progress, (void *)STR_PROGRESS_LALIGN);
-			if (left_align_text(&file) == -1)
-				goto fail;
-			break;
-		case RALIGN:
-			pthread_create(&TID_SP, NULL, show_progress, (void *)STR_PROGRESS_RALIGN);
-			if (right_align_text(&file) == -1)
-				goto fail;
-			break;
-		case CALIGN:
-			pthread_create(&TID_SP, NULL, show_progress, (void *)STR_PROGRESS_CALIGN);
-			if (centre_align_text(&file) == -1)
-				goto fail;
-			break;
+		fprintf(stderr, "main: %d phase(s) exceeded their bounds\n", ACCT_VIOLATIONS);
+		failed = 1;
 	}
+#endif
 
-	unmap_file(&file);
-	exit(EXIT_SUCCESS);
+	free(workers);
+	free(JOBS);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 
 	fail:
-	unmap_file(&file);
+	render_finish();
+	free(JOBS);
 	exit(EXIT_FAILURE);
 }